@@ -7,63 +7,191 @@
 #include <sched.h>
 #include <chrono>
 #include <atomic>
-#include <unordered_map>
 #include <cmath> 
 #include <fstream>     
 #include <map>            
 #include <list>             
 #include <ctime>  
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
 
 using namespace std;
 
+// Two-level bitmap of non-empty priority levels, supporting up to 64 * 64 levels
+//  Bit l % 64 of words[l / 64] is set while level l has a waiting thread, and bit w of summary is set
+//  while words[w] is non-zero, so the highest non-empty level is two count-trailing-zeros away.
+class LevelBitmap {
+
+    public:
+        static const int maxLevels = 64 * 64;
+
+        LevelBitmap(int noOfLevels)
+            : words(new atomic<uint64_t>[(noOfLevels + 63) / 64]) {
+            // summary has one bit per word, so more levels would shift past it
+            if (noOfLevels < 1 || noOfLevels > maxLevels) {
+                fprintf(stderr, "LevelBitmap: %d levels, only 1 to %d are supported\n", noOfLevels, maxLevels);
+                abort();
+            }
+            for (int w = 0; w < (noOfLevels + 63) / 64; w++) {
+                words[w].store(0, memory_order_relaxed);
+            }
+        }
+
+        void set(int level) {
+            words[level / 64].fetch_or(uint64_t(1) << (level % 64), memory_order_relaxed);
+            summary.fetch_or(uint64_t(1) << (level / 64), memory_order_relaxed);
+        }
+
+        void clear(int level) {
+            uint64_t left = words[level / 64].fetch_and(~(uint64_t(1) << (level % 64)), memory_order_relaxed);
+            if ((left & ~(uint64_t(1) << (level % 64))) == 0) {
+                summary.fetch_and(~(uint64_t(1) << (level / 64)), memory_order_relaxed);
+            }
+        }
+
+        // Return the lowest set level, or -1 when every level is empty
+        int first() const {
+            uint64_t top = summary.load(memory_order_relaxed);
+            if (top == 0) {
+                return -1;
+            }
+            int w = __builtin_ctzll(top);
+            return w * 64 + __builtin_ctzll(words[w].load(memory_order_relaxed));
+        }
+
+    private:
+        atomic<uint64_t> summary{0};
+        unique_ptr<atomic<uint64_t>[]> words;
+};
+
 class MLFQMutex {
 
     private:
-        unordered_map<pthread_t, int> threads; // Maps threads to their current priority levels
+        // State of one thread for this mutex, alone on its cache line
+        struct alignas(64) ThreadSlot {
+            uint64_t generation = 0; // ThreadRegistry generation of the thread the state belongs to
+            uint64_t epoch = 0; // Boost epoch the level belongs to, an older one means the thread was boosted
+            pthread_t id = 0;
+            int level = 0; // Current priority level
+            uint64_t levelNanos = 0; // Hold time at the current level, a full quantum demotes the thread
+            uint64_t totalNanos = 0; // Hold time since the thread first used the mutex
+        };
+
+        SlotArray<ThreadSlot> threads; // Indexed by ThreadRegistry::index()
 
         atomic_flag flag; // Atomic lock flag to control mutex access
         atomic_flag guard; // Atomic guard flag to protect lock() and unlock() bodies
-        vector<Queue<pthread_t>*> levels; // Vector of queues, each queue represents a priority level
+        vector<LockFreeQueue<int>*> levels; // Vector of queues of thread slot indices, each queue represents a priority level
+        LevelBitmap nonEmpty; // Levels with a waiting thread, only changed while holding the guard
 
         int noOfPriorityLevels; // Total number of priority levels
-        double Qval; // Quantum value used in priority calculation
+        double Qval; // Quantum value used in priority calculation, in seconds
+        uint64_t quantumNanos; // The same quantum in nanoseconds, which the accounting uses
+        uint64_t boostNanos; // Every thread goes back to level 0 after this long, 0 never boosts
+        uint64_t boostEpoch = 1; // Number of boosts so far, plus one
+
+        int spinLimit; // Spins on a held mutex, and then on the park flag, before a waiter sleeps; 0 queues at once
+        bool verbose = true; // Print a line for every thread that has to wait
 
-        chrono::time_point<std::chrono::high_resolution_clock> start; // Holds the time when the mutex is locked
-        chrono::time_point<std::chrono::high_resolution_clock> stop; // Holds the time when the mutex is unlocked
+        chrono::time_point<std::chrono::steady_clock> start; // Holds the time when the mutex is locked
+        chrono::time_point<std::chrono::steady_clock> stop; // Holds the time when the mutex is unlocked
+        chrono::time_point<std::chrono::steady_clock> lastBoost; // Holds the time of the last priority boost
 
         Garage garObj; // Object for managing thread parking 
 
+        // Slot of the calling thread, reset when the thread is new to this mutex or reuses a dead thread's index
+        ThreadSlot &currentSlot() {
+            ThreadSlot &slot = threads.mine();
+            if (slot.generation != ThreadRegistry::generation()) {
+                slot = ThreadSlot(); // New threads start at the highest priority
+                slot.generation = ThreadRegistry::generation();
+                slot.id = pthread_self();
+            }
+            if (slot.epoch != boostEpoch) {
+                slot.epoch = boostEpoch; // A boost happened since the thread last held the mutex
+                slot.level = 0;
+                slot.levelNanos = 0;
+            }
+            return slot;
+        }
+
         // Update priority based on mutex hold time
-        void updatePriorityLevel(pthread_t tid, chrono::seconds duration) {
-            double execTime = duration.count();  // Get execution time in seconds
-            int currentLevel = threads[tid];  // Get current priority level of the thread
-            int newPriorityLevel = currentLevel + static_cast<int>(floor(execTime / Qval));  // Calculate new priority level based on execution time
+        void updatePriorityLevel(ThreadSlot &slot, chrono::nanoseconds duration) {
+            uint64_t execTime = duration.count();  // Get execution time in nanoseconds
+            slot.totalNanos += execTime;
+            slot.levelNanos += execTime; // Short holds add up until they fill a quantum
+
+            int newPriorityLevel = slot.level + static_cast<int>(slot.levelNanos / quantumNanos);  // Calculate new priority level based on execution time
+            slot.levelNanos %= quantumNanos; // What is left counts towards the next level
 
             // Ensure the new priority level does not exceed the maximum available level
             if (newPriorityLevel >= noOfPriorityLevels) {
                 newPriorityLevel = noOfPriorityLevels - 1;
             }
 
-            threads[tid] = newPriorityLevel; 
+            slot.level = newPriorityLevel; 
         }
 
-        // Enqueue thread to its priority level
-        void enqueueThread() {
-            pthread_t currentThread = pthread_self();
+        // Anti-starvation aging: move every thread back to level 0, waiters keep their order within each level
+        void boostAll() {
+            boostEpoch++; // Threads that are not waiting reset their level the next time they use the mutex
+            lastBoost = stop;
+
+            for (int level = 1; level < noOfPriorityLevels; level++) {
+                int index;
+                while (levels[level]->tryDequeue(index)) {
+                    ThreadSlot &slot = threads.at(index);
+                    slot.epoch = boostEpoch;
+                    slot.level = 0;
+                    slot.levelNanos = 0;
+                    levels[0]->enqueue(index);
+                    nonEmpty.set(0);
+                }
+                nonEmpty.clear(level);
+            }
+        }
+
+        // Spin with exponential backoff until the guard is ours
+        void acquireGuard() {
+            Backoff backoff;
+            while (guard.test_and_set(std::memory_order_acquire)) {
+                // Wait for the guard to look free before trying again, so waiters do not bounce its cache line
+                while (guard.test(std::memory_order_relaxed)) {
+                    backoff.pause();
+                }
+            }
+        }
 
-            // Enqueue the thread ID provided by 'tid' to the queue corresponding to its level
-            levels[threads[currentThread]]->enqueue(currentThread);
+        // Adaptive mode: try to take a free mutex for up to spinLimit rounds before joining a queue
+        bool trySpin() {
+            Backoff backoff;
+            for (int i = 0; i < spinLimit; i++) {
+                if (!flag.test(std::memory_order_relaxed) && !flag.test_and_set(std::memory_order_acquire)) {
+                    return true;
+                }
+                backoff.pause();
+            }
+            return false;
         }
 
-        // Return the thread ID of the highest priority thread that can be run next
-        pthread_t highestPriorityThread() {
-            pthread_t next_thread = -1; // Initialize to -1, indicating no thread is available
+        // Enqueue thread to its priority level
+        void enqueueThread(ThreadSlot &slot) {
+            // Enqueue the slot index of the thread to the queue corresponding to its level
+            levels[slot.level]->enqueue(ThreadRegistry::index());
+            nonEmpty.set(slot.level);
+        }
 
-            // Loop through priority levels from highest to lowest to find a runnable thread
-            for(int i = 0; i < noOfPriorityLevels; i++) {
-                if(!levels[i]->isEmpty()) {
-                    next_thread = levels[i]->dequeue();
-                    break;
+        // Return the slot index of the highest priority thread that can be run next
+        int highestPriorityThread() {
+            int next_thread = -1; // Initialize to -1, indicating no thread is available
+
+            // The highest non-empty level comes straight from the bitmap
+            int level = nonEmpty.first();
+            if (level >= 0) {
+                next_thread = levels[level]->dequeue();
+                if (levels[level]->isEmpty()) {
+                    nonEmpty.clear(level); // That was the last waiter of the level
                 }
             }
 
@@ -72,10 +200,14 @@ class MLFQMutex {
 
         
     public:
-        MLFQMutex(int givenNoOfPriorityLevels, double givenQval)
-            : noOfPriorityLevels(givenNoOfPriorityLevels), Qval(givenQval) {
+        // The quantum is in seconds, setQuantumNanos() sets it more finely. Priorities are boosted every
+        // 100 quanta unless setBoostNanos() says otherwise.
+        MLFQMutex(int givenNoOfPriorityLevels, double givenQval, int givenSpinLimit = 0)
+            : nonEmpty(givenNoOfPriorityLevels), noOfPriorityLevels(givenNoOfPriorityLevels), Qval(givenQval),
+              spinLimit(givenSpinLimit), lastBoost(chrono::steady_clock::now()) {
+            setQuantumNanos(llround(givenQval * 1e9));
             for (int i = 0; i < givenNoOfPriorityLevels; i++) {
-                levels.push_back(new Queue<pthread_t>()); // Initialize queues for each priority level
+                levels.push_back(new LockFreeQueue<int>()); // Initialize queues for each priority level
             }
 
             // Initialize flags
@@ -84,16 +216,50 @@ class MLFQMutex {
         }
 
         ~MLFQMutex() {
-            for (Queue<pthread_t>* level : levels) {
+            for (LockFreeQueue<int>* level : levels) {
                 delete level;  // Clean up memory by deleting each queue
         }
 }
 
 
         
-       void lock() {
-            // Spin until the guard is successfully acquired
-            while (guard.test_and_set(std::memory_order_acquire));
+        // Change the adaptive spin limit, 0 restores strict queueing
+        void setSpinLimit(int givenSpinLimit) {
+            spinLimit = givenSpinLimit;
+        }
+
+        void setVerbose(bool givenVerbose) {
+            verbose = givenVerbose;
+        }
+
+        // Set the hold time that demotes a thread by one level, and the boost period to 100 of them
+        void setQuantumNanos(uint64_t givenQuantumNanos) {
+            quantumNanos = givenQuantumNanos > 0 ? givenQuantumNanos : 1;
+            Qval = quantumNanos / 1e9;
+            boostNanos = 100 * quantumNanos;
+        }
+
+        // Set the priority boost period, 0 turns boosting off
+        void setBoostNanos(uint64_t givenBoostNanos) {
+            boostNanos = givenBoostNanos;
+        }
+
+        // Total time the calling thread has held the mutex, in nanoseconds
+        uint64_t holdTimeNanos() {
+            acquireGuard();
+            uint64_t total = currentSlot().totalNanos;
+            guard.clear(memory_order_release);
+            return total;
+        }
+
+        void lock() {
+            if (trySpin()) {
+                start = std::chrono::steady_clock::now(); // The mutex was free, start timing
+                return;
+            }
+
+            acquireGuard();
+            ThreadSlot &slot = currentSlot();
 
             if (!flag.test_and_set(std::memory_order_acquire)) {
                 // If mutex is free, acquire it and start timing
@@ -102,32 +268,44 @@ class MLFQMutex {
              
             else {
 
+                enqueueThread(slot); // Wait in the queue of the thread's level
                 garObj.setPark(); // Prepare the thread to park
                 
-                printf("Adding thread with ID: %lu to level %d\n", (unsigned long)pthread_self(), threads[pthread_self()]);
-                fflush(stdout);
+                if (verbose) {
+                    printf("Adding thread with ID: %lu to level %d\n", (unsigned long)slot.id, slot.level);
+                    fflush(stdout);
+                }
                 
-                // Release guard and park the thread
+                // Release guard and park the thread, unlock() hands the mutex over without clearing the flag
                 guard.clear(std::memory_order_release);
-                garObj.park();
+                garObj.park(spinLimit);
             }
 
-            start = std::chrono::high_resolution_clock::now(); // Record the time when the mutex is acquired
+            start = std::chrono::steady_clock::now(); // Record the time when the mutex is acquired
            
         }
 
         void unlock() {
 
-            while (guard.test_and_set(memory_order_acquire));
+            acquireGuard();
+
+            stop = chrono::steady_clock::now(); // Record the time when the mutex is released
 
-            stop = chrono::high_resolution_clock::now(); // Record the time when the mutex is released
+            auto duration = chrono::duration_cast<chrono::nanoseconds>(stop - start);
+            updatePriorityLevel(currentSlot(), duration); // Adjust priority based on the hold time
 
-            if (threads.find(pthread_self()) != threads.end()) {
-                auto duration = chrono::duration_cast<chrono::seconds>(stop - start);
-                updatePriorityLevel(pthread_self(), duration); // Adjust priority based on the hold time
+            if (boostNanos != 0 && (uint64_t)chrono::duration_cast<chrono::nanoseconds>(stop - lastBoost).count() >= boostNanos) {
+                boostAll(); // Time for threads that sank to get back to the top
             }
 
-            pthread_t highestPriorityThreadId = highestPriorityThread(); // Get the highest priority thread ready to run
+            int highestPriorityThreadId = highestPriorityThread(); // Get the highest priority thread ready to run
+
+            if (highestPriorityThreadId == -1) {
+                flag.clear(memory_order_release); // Nobody is waiting, the mutex is free
+            }
+            else {
+                garObj.unpark(highestPriorityThreadId); // The waiter now owns the mutex
+            }
             
             guard.clear(memory_order_release); // Release the guard
         }
@@ -135,10 +313,15 @@ class MLFQMutex {
         // Print the queue of each level
         void print() {
             printf("Waiting threads:");
-            for(int i = 0; i < noOfPriorityLevels + 1; i++) {
+            for(int i = 0; i < noOfPriorityLevels; i++) {
                 printf("\nLevel %d:",i);
                 fflush(stdout);
-                levels[i]->print();
+                if (levels[i]->isEmpty()) {
+                    cout << "Empty";
+                }
+                else {
+                    levels[i]->forEach([this](int index) { cout << " " << threads.at(index).id; });
+                }
             }
             cout << endl;
         }
@@ -0,0 +1,81 @@
+// Throughput and CPU usage of MLFQMutex under contention
+//  Every thread takes the mutex `iterations` times around a short critical section. Each spin limit is
+//  one run; spin limit 0 is the strict queueing mutex, where a waiter parks as soon as the mutex is held.
+//
+//  usage: mutexBench [threads] [iterations] [spin limits...]
+#include "MLFQMutex.h"
+#include <sys/resource.h>
+#include <vector>
+
+struct BenchArgs {
+    MLFQMutex *mutex;
+    int iterations;
+    long *counter;
+};
+
+void *worker(void *arg) {
+    BenchArgs *args = (BenchArgs *)arg;
+    for (int i = 0; i < args->iterations; i++) {
+        args->mutex->lock();
+        for (int k = 0; k < 16; k++) {
+            (*args->counter)++; // Short critical section touching shared data
+        }
+        args->mutex->unlock();
+    }
+    return nullptr;
+}
+
+// User plus system CPU time of the whole process, in seconds
+double cpuSeconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Run one configuration and print its line, returning false if the mutex let two threads in at once
+bool runBench(int noOfThreads, int iterations, int spinLimit) {
+    MLFQMutex mutex(4, 1, spinLimit);
+    mutex.setVerbose(false);
+    long counter = 0;
+    BenchArgs args = { &mutex, iterations, &counter };
+    vector<pthread_t> threadIds(noOfThreads);
+
+    double cpuStart = cpuSeconds();
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < noOfThreads; i++) {
+        pthread_create(&threadIds[i], NULL, worker, &args);
+    }
+    for (int i = 0; i < noOfThreads; i++) {
+        pthread_join(threadIds[i], NULL);
+    }
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double cpu = cpuSeconds() - cpuStart;
+
+    long ops = (long)noOfThreads * iterations;
+    printf("%-10s %10d %8d %14.0f %10.1f %12.2f\n", spinLimit == 0 ? "queue" : "adaptive", spinLimit, noOfThreads,
+           ops / wall, 100 * cpu / wall, 1e6 * cpu / ops);
+    return counter == ops * 16;
+}
+
+int main(int argc, char **argv) {
+    int noOfThreads = argc > 1 ? atoi(argv[1]) : 16;
+    int iterations = argc > 2 ? atoi(argv[2]) : 20000;
+    vector<int> spinLimits;
+    for (int i = 3; i < argc; i++) {
+        spinLimits.push_back(atoi(argv[i]));
+    }
+    if (spinLimits.empty()) {
+        spinLimits = { 0, 16, 128, 1024 };
+    }
+
+    printf("%-10s %10s %8s %14s %10s %12s\n", "mode", "spinLimit", "threads", "locks/s", "cpu %", "cpu us/lock");
+    bool ok = true;
+    for (int spinLimit : spinLimits) {
+        ok = runBench(noOfThreads, iterations, spinLimit) && ok;
+    }
+    if (!ok) {
+        printf("Mutual exclusion violated: the shared counter lost updates.\n");
+        return 1;
+    }
+    return 0;
+}
@@ -4,38 +4,101 @@
 #include <iostream>
 #include <mutex>
 #include <atomic>
-#include <unordered_map>
 #include <thread>
+#include <cstdint>
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "slots.h"
 
 using namespace std;
 
+// Tell the CPU we are spinning, so the sibling hyperthread and the memory bus are not starved
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Exponential backoff for spin loops: each pause() spins twice as long as the previous one, up to a cap,
+// and then gives the core away so a preempted lock holder can run
+class Backoff {
+private:
+    static const int maxSpins = 1024;
+    int spins = 1;
+
+public:
+    void pause() {
+        if (spins > maxSpins) {
+            sched_yield();
+            return;
+        }
+        for (int i = 0; i < spins; i++) {
+            cpuRelax();
+        }
+        spins *= 2;
+    }
+};
+
 class Garage {
 private:
-    unordered_map<pthread_t, atomic<bool>> flag_map;
+    // Park states: the waiter is about to park, it was unparked, or it sleeps on the futex
+    enum : uint32_t { PARKING = 0, UNPARKED = 1, SLEEPING = 2 };
+
+    // Park flag of one thread, alone on its cache line so waking one waiter does not disturb the others
+    struct alignas(64) ParkSlot {
+        atomic<uint32_t> state{UNPARKED};
+    };
+
+    SlotArray<ParkSlot> slots; // Indexed by ThreadRegistry::index()
+
+    static void futexWait(atomic<uint32_t>* flag, uint32_t value) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(flag), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+    }
+
+    static void futexWake(atomic<uint32_t>* flag) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(flag), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
 
 public:
     Garage() = default;
     ~Garage() = default;
 
+    // Called while holding the guard, before the thread can be unparked
     void setPark() {
-        pthread_t current_id = pthread_self();
-        atomic<bool>& flag = flag_map[current_id];
-        flag = false;
+        slots.mine().state.store(PARKING, memory_order_relaxed);
     }
 
-    void park() {
-        pthread_t current_id = pthread_self();
-        atomic<bool>& flag = flag_map[current_id];
+    // Wait until unpark(), spinning up to spinLimit times before sleeping on the futex
+    void park(int spinLimit = 0) {
+        atomic<uint32_t>* flag = &slots.mine().state;
+        Backoff backoff;
+
+        for (int i = 0; i < spinLimit; i++) {
+            if (flag->load(memory_order_acquire) == UNPARKED) {
+                return;
+            }
+            backoff.pause();
+        }
 
-        flag.wait(false);        
+        uint32_t state = PARKING;
+        if (flag->compare_exchange_strong(state, SLEEPING, memory_order_acquire)) {
+            // Sleep until unpark() changes the state, futexWait() returns at once if it already has
+            while (flag->load(memory_order_acquire) == SLEEPING) {
+                futexWait(flag, SLEEPING);
+            }
+        }
     }
 
-    void unpark(pthread_t id) {
-        auto it = flag_map.find(id);
-        if (it != flag_map.end()) {
-            it->second.store(true);
-            it->second.notify_one();
-            
+    // Wake the thread with the given ThreadRegistry index, called once it has called setPark()
+    void unpark(int index) {
+        atomic<uint32_t>* flag = &slots.at(index).state;
+        // Only a thread that gave up spinning needs the system call
+        if (flag->exchange(UNPARKED, memory_order_release) == SLEEPING) {
+            futexWake(flag);
         }
     }
 };
@@ -0,0 +1,143 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <utility>
+
+using namespace std;
+
+// Node allocators for the queues
+//  An allocator is a class template over the node type with static create(args...) and destroy(node).
+//  Queues take it as a template template parameter, so Queue<T, HeapAllocator> goes back to new/delete.
+
+// Every node straight from the global heap
+template <class N>
+struct HeapAllocator {
+    template <class... Args>
+    static N *create(Args&&... args) {
+        return new N(std::forward<Args>(args)...);
+    }
+
+    static void destroy(N *node) {
+        delete node;
+    }
+};
+
+// Pooled allocator: each thread keeps a cache of free nodes, so create() and destroy() only touch
+// thread-local memory. A thread that runs dry takes a batch from the shared free list, or carves a
+// new slab of batchSize nodes out of one heap allocation; a thread whose cache grows past two batches
+// gives one back. Slabs are never returned to the heap, so once the pool has grown to the peak number
+// of live nodes no operation allocates.
+template <class N>
+class NodePool {
+
+    union Slot {
+        Slot *next; // Link while the slot is free
+        alignas(N) unsigned char storage[sizeof(N)]; // The node while it is in use
+    };
+
+    struct Cache {
+        Slot *free = nullptr; // Free slots of this thread
+        size_t count = 0;
+
+        // Give the slots of an exiting thread to the others
+        ~Cache() {
+            while (free != nullptr) {
+                giveBatch(*this);
+            }
+        }
+    };
+
+    public:
+
+    static const size_t batchSize = 64; // Slots per slab and per transfer between a cache and the shared list
+
+    struct Stats {
+        size_t slabs; // Heap allocations made by the pool
+        size_t bytes; // Bytes held in those slabs
+    };
+
+    template <class... Args>
+    static N *create(Args&&... args) {
+        Cache &c = cache();
+        if (c.free == nullptr) {
+            takeBatch(c);
+        }
+        Slot *slot = c.free;
+        c.free = slot->next;
+        c.count--;
+        return new (slot->storage) N(std::forward<Args>(args)...);
+    }
+
+    static void destroy(N *node) {
+        node->~N();
+        Slot *slot = reinterpret_cast<Slot*>(node);
+        Cache &c = cache();
+        slot->next = c.free;
+        c.free = slot;
+        if (++c.count > 2 * batchSize) {
+            giveBatch(c);
+        }
+    }
+
+    static Stats stats() {
+        return { slabs.load(memory_order_relaxed), slabs.load(memory_order_relaxed) * batchSize * sizeof(Slot) };
+    }
+
+    private:
+
+    static inline mutex sharedLock; // Protects sharedFree
+    static inline Slot *sharedFree = nullptr; // Free slots given back by threads
+    static inline atomic<size_t> slabs{0};
+
+    static Cache &cache() {
+        thread_local Cache c;
+        return c;
+    }
+
+    // Refill an empty cache from the shared list, or from a new slab when that is empty too
+    static void takeBatch(Cache &c) {
+        {
+            lock_guard<mutex> lock(sharedLock);
+            while (sharedFree != nullptr && c.count < batchSize) {
+                Slot *slot = sharedFree;
+                sharedFree = slot->next;
+                slot->next = c.free;
+                c.free = slot;
+                c.count++;
+            }
+        }
+        if (c.free != nullptr) {
+            return;
+        }
+
+        Slot *slab = static_cast<Slot*>(::operator new(batchSize * sizeof(Slot), align_val_t(alignof(Slot))));
+        slabs.fetch_add(1, memory_order_relaxed);
+        for (size_t i = 0; i < batchSize; i++) {
+            slab[i].next = c.free;
+            c.free = &slab[i];
+        }
+        c.count = batchSize;
+    }
+
+    // Move up to one batch of free slots from the cache to the shared list
+    static void giveBatch(Cache &c) {
+        Slot *first = c.free;
+        Slot *last = first;
+        size_t moved = 1;
+        while (last->next != nullptr && moved < batchSize) {
+            last = last->next;
+            moved++;
+        }
+        c.free = last->next;
+        c.count -= moved;
+
+        lock_guard<mutex> lock(sharedLock);
+        last->next = sharedFree;
+        sharedFree = first;
+    }
+};
+
+#endif /* POOL_H */
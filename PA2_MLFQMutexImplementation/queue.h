@@ -5,7 +5,10 @@
 #include <vector>
 #include <string> 
 #include <fstream> 
+#include <atomic>
+#include <algorithm>
 #include "park.h"
+#include "pool.h"
 
 #ifndef QUEUE_H
 #define QUEUE_H
@@ -31,14 +34,15 @@ struct Node {
         : value(givenValue), next(givenNext) {}
 };
 
-template <class T>
+// Nodes come from a NodePool by default, pass HeapAllocator as Alloc for plain new/delete
+template <class T, template <class> class Alloc = NodePool>
 class Queue {
 
     public:
     
     // Default constructor
     Queue() {
-        Node<T> *dummyNode = new Node<T>(); // Create a dummy node
+        Node<T> *dummyNode = Alloc<Node<T>>::create(); // Create a dummy node
         head = dummyNode; // Head points to dummy node
         tail = dummyNode; // Tail also points to dummy node
         pthread_mutex_init(&head_lock, NULL); // Initialize head mutex
@@ -50,6 +54,7 @@ class Queue {
         while (head != nullptr) {
             Node<T>* temp = head;
             head = head->next;
+            Alloc<Node<T>>::destroy(temp);
         }
         // Destroy mutexes
         pthread_mutex_destroy(&head_lock);
@@ -58,7 +63,7 @@ class Queue {
 
     // Enqueue method
     void enqueue(T item) {
-        Node<T> *newNode = new Node<T>(item); // Create new node
+        Node<T> *newNode = Alloc<Node<T>>::create(item); // Create new node
 
         pthread_mutex_lock(&tail_lock); // Lock tail mutex
 
@@ -75,11 +80,9 @@ class Queue {
         Node<T> *dummyNode = head;
         Node<T> *newDummyNode = dummyNode->next; // Next node becomes the new dummy
 
-        pthread_mutex_unlock(&head_lock); // Unlock head mutex
-
         T curHeadVal = newDummyNode->value; // Value of current head
         head = newDummyNode; // Update head
-        delete dummyNode; // Delete old dummy node
+        Alloc<Node<T>>::destroy(dummyNode); // Delete old dummy node
         pthread_mutex_unlock(&head_lock); // Unlock head mutex
 
         return curHeadVal; // Return the value
@@ -111,4 +114,248 @@ class Queue {
         
 };
 
+// Hazard pointers: safe memory reclamation for the lock-free queue
+//  A thread publishes the nodes it is about to dereference in its hazard slots. Removed nodes are
+//  retired instead of deleted, and a retired node is only deleted once no slot of any thread holds it.
+//  Records are never freed: a thread that exits gives its record, and any nodes still retired in it,
+//  to the next thread that needs one.
+struct HazardRecord {
+    static const int slots = 2; // Nodes one queue operation can hold at once
+
+    atomic<void*> hazards[slots];
+    atomic<bool> active;
+    HazardRecord *next;
+    vector<pair<void*, void (*)(void*)>> retired; // Nodes waiting for deletion, with their deleter
+
+    HazardRecord()
+        : active(true), next(nullptr) {
+        for (int i = 0; i < slots; i++) {
+            hazards[i].store(nullptr);
+        }
+    }
+};
+
+class HazardPointers {
+
+    public:
+
+    // Return the calling thread's record, taking a free one or adding a new one on first use
+    static HazardRecord *record() {
+        thread_local Owner owner;
+        if (owner.rec == nullptr) {
+            owner.rec = acquire();
+        }
+        return owner.rec;
+    }
+
+    // Publish the node *src points to in slot i, retrying until the published value is still current
+    template <class N>
+    static N *protect(int i, const atomic<N*> &src) {
+        HazardRecord *rec = record();
+        N *node = src.load();
+        while (true) {
+            rec->hazards[i].store(node);
+            N *again = src.load();
+            if (again == node) {
+                return node;
+            }
+            node = again;
+        }
+    }
+
+    static void clear() {
+        HazardRecord *rec = record();
+        for (int i = 0; i < HazardRecord::slots; i++) {
+            rec->hazards[i].store(nullptr, memory_order_release);
+        }
+    }
+
+    // Give node back to Alloc once no thread holds it
+    template <class Alloc, class N>
+    static void retire(N *node) {
+        HazardRecord *rec = record();
+        rec->retired.push_back({ node, [](void *p) { Alloc::destroy(static_cast<N*>(p)); } });
+        if (rec->retired.size() >= retireThreshold) {
+            scan(rec);
+        }
+    }
+
+    private:
+
+    static const size_t retireThreshold = 64; // Retired nodes a thread collects before it scans
+
+    static inline atomic<HazardRecord*> records{nullptr}; // Every record ever created
+
+    // Releases the record when its thread exits
+    struct Owner {
+        HazardRecord *rec = nullptr;
+        ~Owner() {
+            if (rec != nullptr) {
+                for (int i = 0; i < HazardRecord::slots; i++) {
+                    rec->hazards[i].store(nullptr, memory_order_release);
+                }
+                rec->active.store(false, memory_order_release);
+            }
+        }
+    };
+
+    static HazardRecord *acquire() {
+        for (HazardRecord *rec = records.load(); rec != nullptr; rec = rec->next) {
+            bool inactive = false;
+            if (!rec->active.load(memory_order_relaxed) && rec->active.compare_exchange_strong(inactive, true)) {
+                return rec;
+            }
+        }
+        HazardRecord *rec = new HazardRecord();
+        rec->next = records.load();
+        while (!records.compare_exchange_weak(rec->next, rec));
+        return rec;
+    }
+
+    // Delete the retired nodes of rec that no hazard slot holds
+    static void scan(HazardRecord *rec) {
+        vector<void*> held;
+        for (HazardRecord *other = records.load(); other != nullptr; other = other->next) {
+            for (int i = 0; i < HazardRecord::slots; i++) {
+                void *node = other->hazards[i].load();
+                if (node != nullptr) {
+                    held.push_back(node);
+                }
+            }
+        }
+        sort(held.begin(), held.end());
+
+        size_t kept = 0;
+        for (auto &entry : rec->retired) {
+            if (binary_search(held.begin(), held.end(), entry.first)) {
+                rec->retired[kept++] = entry; // Still in use, try again at the next scan
+            }
+            else {
+                entry.second(entry.first);
+            }
+        }
+        rec->retired.resize(kept);
+    }
+};
+
+// Lock-free multi-producer multi-consumer queue (Michael and Scott), a drop-in for Queue<T>
+//  Like Queue<T>, it keeps a dummy node at the head and takes its nodes from Alloc. dequeue() returns
+//  T() when the queue is empty; tryDequeue() reports emptiness instead.
+template <class T, template <class> class Alloc = NodePool>
+class LockFreeQueue {
+
+    public:
+
+    struct LFNode {
+        T value; // Value contained in the node
+        atomic<LFNode*> next; // Pointer to the next node in the queue
+
+        LFNode()
+            : value(), next(nullptr) {}
+        LFNode(T givenValue)
+            : value(givenValue), next(nullptr) {}
+    };
+    typedef LFNode Node; // For naming the pool of this queue's nodes
+
+    LockFreeQueue() {
+        LFNode *dummyNode = Alloc<LFNode>::create(); // Create a dummy node
+        head.store(dummyNode);
+        tail.store(dummyNode);
+    }
+
+    // Destructor, only safe once no other thread uses the queue
+    ~LockFreeQueue() {
+        LFNode *node = head.load();
+        while (node != nullptr) {
+            LFNode *next = node->next.load();
+            Alloc<LFNode>::destroy(node);
+            node = next;
+        }
+    }
+
+    void enqueue(T item) {
+        LFNode *newNode = Alloc<LFNode>::create(item); // Create new node
+
+        while (true) {
+            LFNode *last = HazardPointers::protect(0, tail);
+            LFNode *next = last->next.load();
+            if (last != tail.load()) {
+                continue; // Tail moved while we read it
+            }
+            if (next == nullptr) {
+                // Link the new node after the last one, then try to swing the tail to it
+                if (last->next.compare_exchange_weak(next, newNode)) {
+                    tail.compare_exchange_strong(last, newNode);
+                    break;
+                }
+            }
+            else {
+                tail.compare_exchange_strong(last, next); // Help a slower enqueue finish
+            }
+        }
+        HazardPointers::clear();
+    }
+
+    // Take the value at the head, returning false if the queue is empty
+    bool tryDequeue(T &item) {
+        while (true) {
+            LFNode *first = HazardPointers::protect(0, head);
+            LFNode *last = tail.load();
+            LFNode *next = HazardPointers::protect(1, first->next);
+            if (first != head.load()) {
+                continue; // Head moved while we read it
+            }
+            if (next == nullptr) {
+                HazardPointers::clear();
+                return false;
+            }
+            if (first == last) {
+                tail.compare_exchange_strong(last, next); // Tail lags behind, help it along
+                continue;
+            }
+            T value = next->value; // Read before the swing, another dequeue may retire next right after
+            if (head.compare_exchange_weak(first, next)) {
+                HazardPointers::clear();
+                HazardPointers::retire<Alloc<LFNode>>(first); // The old dummy, next becomes the new one
+                item = value;
+                return true;
+            }
+        }
+    }
+
+    T dequeue() {
+        T item = T();
+        tryDequeue(item);
+        return item;
+    }
+
+    bool isEmpty() {
+        LFNode *first = HazardPointers::protect(0, head);
+        bool empty = first->next.load() == nullptr;
+        HazardPointers::clear();
+        return empty;
+    }
+
+    // Call f on every queued value from head to tail, only meaningful while no other thread changes the queue
+    template <class F>
+    void forEach(F f) {
+        for (LFNode *node = head.load()->next.load(); node != nullptr; node = node->next.load()) {
+            f(node->value);
+        }
+    }
+
+    // Print the queue values, with the same caveat as forEach()
+    void print() {
+        if (isEmpty()) {
+            cout << "Empty";
+            return;
+        }
+        forEach([](const T &value) { cout << " " << value; });
+    }
+
+    private:
+        alignas(64) atomic<LFNode*> head; // Dummy node, dequeues start here
+        alignas(64) atomic<LFNode*> tail; // Last node or close to it, enqueues start here
+};
+
 #endif /* QUEUE_H */
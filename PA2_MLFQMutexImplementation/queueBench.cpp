@@ -0,0 +1,70 @@
+// Throughput of the two-lock Queue<T> and the lock-free LockFreeQueue<T>, with heap and pooled nodes
+//  Every thread repeatedly enqueues a value and dequeues one, so the queue never runs dry, for a fixed
+//  number of pairs. Thread counts double from 1 up to the given maximum. The last column counts the
+//  slabs the node pools allocated during the measured runs, after one warm-up run per thread count.
+//
+//  usage: queueBench [max threads] [pairs per thread]
+#include "queue.h"
+#include <chrono>
+
+template <class Q>
+struct BenchArgs {
+    Q *queue;
+    int pairs;
+};
+
+template <class Q>
+void *worker(void *arg) {
+    BenchArgs<Q> *args = (BenchArgs<Q> *)arg;
+    for (int i = 0; i < args->pairs; i++) {
+        args->queue->enqueue(i);
+        args->queue->dequeue();
+    }
+    return nullptr;
+}
+
+// Run one queue type with the given number of threads and return operations per second
+template <class Q>
+double runBench(int noOfThreads, int pairs) {
+    Q queue;
+    BenchArgs<Q> args = { &queue, pairs };
+    vector<pthread_t> threadIds(noOfThreads);
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < noOfThreads; i++) {
+        pthread_create(&threadIds[i], NULL, worker<Q>, &args);
+    }
+    for (int i = 0; i < noOfThreads; i++) {
+        pthread_join(threadIds[i], NULL);
+    }
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return 2.0 * noOfThreads * pairs / wall;
+}
+
+// Slabs allocated so far by the pools of both queues
+size_t poolSlabs() {
+    return NodePool<Node<long>>::stats().slabs + NodePool<LockFreeQueue<long>::Node>::stats().slabs;
+}
+
+int main(int argc, char **argv) {
+    int maxThreads = argc > 1 ? atoi(argv[1]) : 64;
+    int pairs = argc > 2 ? atoi(argv[2]) : 50000;
+
+    printf("%8s %14s %14s %14s %14s %12s\n", "threads", "two-lock heap", "two-lock pool", "lock-free heap",
+           "lock-free pool", "pool slabs");
+    for (int noOfThreads = 1; noOfThreads <= maxThreads; noOfThreads *= 2) {
+        runBench<Queue<long>>(noOfThreads, pairs); // Warm up the pools
+        runBench<LockFreeQueue<long>>(noOfThreads, pairs);
+        size_t slabs = poolSlabs();
+
+        double twoLockHeap = runBench<Queue<long, HeapAllocator>>(noOfThreads, pairs);
+        double twoLockPool = runBench<Queue<long>>(noOfThreads, pairs);
+        double lockFreeHeap = runBench<LockFreeQueue<long, HeapAllocator>>(noOfThreads, pairs);
+        double lockFreePool = runBench<LockFreeQueue<long>>(noOfThreads, pairs);
+        printf("%8d %14.0f %14.0f %14.0f %14.0f %12zu\n", noOfThreads, twoLockHeap, twoLockPool, lockFreeHeap,
+               lockFreePool, poolSlabs() - slabs);
+    }
+    printf("Pools hold %zu bytes in total.\n", NodePool<Node<long>>::stats().bytes +
+           NodePool<LockFreeQueue<long>::Node>::stats().bytes);
+    return 0;
+}
@@ -0,0 +1,124 @@
+#ifndef SLOTS_H
+#define SLOTS_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+// Per-thread slots
+//  Every thread gets a small index the first time it asks, and gives it back when it exits, so indices
+//  stay dense. Objects that keep per-thread state store it in a SlotArray at that index instead of
+//  hashing pthread_t. A reused index comes with a new generation, so state left by the previous owner
+//  can be told apart from the current thread's.
+class ThreadRegistry {
+
+    public:
+        static const int maxThreads = 64 * 64; // Threads alive at once
+
+        struct Entry {
+            int index = -1;
+            uint64_t generation = 0;
+
+            ~Entry() {
+                if (index >= 0) {
+                    ThreadRegistry::release(index);
+                }
+            }
+        };
+
+        // Index of the calling thread, assigned on its first call
+        static int index() {
+            return self().index;
+        }
+
+        // Registration number of the calling thread, never reused
+        static uint64_t generation() {
+            return self().generation;
+        }
+
+    private:
+        static inline mutex registryLock; // Protects freeIndices and nextIndex, only taken when threads start and exit
+        static inline vector<int> freeIndices;
+        static inline int nextIndex = 0;
+        static inline uint64_t nextGeneration = 1;
+
+        static Entry &self() {
+            thread_local Entry entry;
+            if (entry.index < 0) {
+                lock_guard<mutex> lock(registryLock);
+                if (!freeIndices.empty()) {
+                    entry.index = freeIndices.back();
+                    freeIndices.pop_back();
+                }
+                else {
+                    // Every SlotArray is sized for maxThreads, a larger index would run past its chunks
+                    if (nextIndex >= maxThreads) {
+                        fprintf(stderr, "ThreadRegistry: more than %d threads alive at once\n", maxThreads);
+                        abort();
+                    }
+                    entry.index = nextIndex++;
+                }
+                entry.generation = nextGeneration++;
+            }
+            return entry;
+        }
+
+        static void release(int index) {
+            lock_guard<mutex> lock(registryLock);
+            freeIndices.push_back(index);
+        }
+};
+
+// Array of per-thread slots indexed by ThreadRegistry::index()
+//  Slots are allocated in chunks on first use and never move, so a reference to a slot stays valid while
+//  other threads register, and looking a slot up takes no lock.
+template <class S>
+class SlotArray {
+
+    public:
+        static const int chunkSize = 64;
+
+        SlotArray() {
+            for (int c = 0; c < maxChunks; c++) {
+                chunks[c].store(nullptr, memory_order_relaxed);
+            }
+        }
+
+        ~SlotArray() {
+            for (int c = 0; c < maxChunks; c++) {
+                delete[] chunks[c].load(memory_order_relaxed);
+            }
+        }
+
+        S &at(int index) {
+            atomic<S*> &chunk = chunks[index / chunkSize];
+            S *slots = chunk.load(memory_order_acquire);
+            if (slots == nullptr) {
+                // First thread in this chunk, the loser of a race frees its copy
+                S *fresh = new S[chunkSize]();
+                if (chunk.compare_exchange_strong(slots, fresh, memory_order_acq_rel)) {
+                    slots = fresh;
+                }
+                else {
+                    delete[] fresh;
+                }
+            }
+            return slots[index % chunkSize];
+        }
+
+        // Slot of the calling thread
+        S &mine() {
+            return at(ThreadRegistry::index());
+        }
+
+    private:
+        static const int maxChunks = ThreadRegistry::maxThreads / chunkSize;
+        atomic<S*> chunks[maxChunks];
+};
+
+#endif /* SLOTS_H */
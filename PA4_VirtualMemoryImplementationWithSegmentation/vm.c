@@ -7,10 +7,25 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
-
-#include "vm_dbg.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#if __has_include("vm_dbg.h")
+#include "vm_dbg.h" // Course debugging hooks, absent from standalone builds such as vmbench
+#endif
+
+// Build with -DVM_SMP to run guest processes on several host threads (see VM_CPUS below).
+// Every piece of per-CPU state is declared VM_LOCAL so each virtual CPU gets its own copy.
+#ifdef VM_SMP
+#include <pthread.h>
+#define VM_LOCAL _Thread_local
+#else
+#define VM_LOCAL
+#endif
 
 #define NOPS (16)
+#define NTRP (10)
 
 #define OPC(i) ((i)>>12)
 #define DR(i) (((i)>>9)&0x7)
@@ -32,8 +47,10 @@
 #define OS_MEM_SIZE 4096    // OS Region size. At the same time, constant free-list starting header 
 
 #define Cur_Proc_ID 0       // id of the current process
-#define Proc_Count 1        // total number of processes, including ones that finished executing.
+#define Proc_Count 1        // number of pids handed out so far; pids of halted processes are recycled
 #define OS_STATUS 2         // Bit 0 shows whether the PCB list is full or not
+#define RQ_HEAD 3           // first pid of the run queue of each MLFQ level, 0xFFFF when the level is empty
+#define LIVE_COUNT 11       // number of processes that have not halted yet
 
 //  Process list and PCB related constants
 #define PCB_SIZE 6  // Number of fields in a PCB
@@ -45,12 +62,102 @@
 #define BSH_PCB 4   // value of heap section for the process
 #define BDH_PCB 5   // holds the bound value of heap section for the process
 
-#define CODE_SIZE 4096
+#define PCB_BASE 12         // address of the first PCB
+#define MAX_PROC_COUNT 340  // number of PCBs that fit in the OS region, pids of halted processes are reused
+
+//  Run queue: circular doubly-linked list of live pids, one link word per pid
+#define RQ_NEXT (PCB_BASE + MAX_PROC_COUNT * PCB_SIZE)  // next live pid after each pid
+#define RQ_PREV (RQ_NEXT + MAX_PROC_COUNT)              // previous live pid before each pid
+#define RQ_LEVEL (RQ_PREV + MAX_PROC_COUNT)             // MLFQ level of each pid, 0 is the highest priority
+#define MLFQ_MAX_LEVELS 8                               // run queue heads fit in OS words 3 to 10
+
+//  Shared code images: processes created from identical code files map the same read-only segment
+#define CODE_IMG (RQ_LEVEL + MAX_PROC_COUNT)            // image table index + 1 of each pid, 0 for a private code segment
+#define IMG_TABLE (CODE_IMG + MAX_PROC_COUNT)           // image table entries
+#define IMG_SIZE 5                                      // Number of fields in an image table entry
+#define IMG_MAX 64                                      // Number of image table entries
+
+#define BASE_IMG 0  // base address of the shared code segment
+#define REFS_IMG 1  // number of processes mapping it, 0 for a free entry
+#define HLO_IMG 2   // low half of the content hash
+#define HHI_IMG 3   // high half of the content hash
+#define LEN_IMG 4   // number of words in the segment
+
+#define HEAP_TOUCHED (IMG_TABLE + IMG_MAX * IMG_SIZE)   // heap words of each pid that hold loaded or zeroed data
+
+#define CODE_SIZE 4096      // largest code segment, images are truncated to it
 #define HEAP_INIT_SIZE 4096
+#define IMG_GRANULE 64      // code segments are sized to the image rounded up to this many words
+
+//  Segregated-fit allocator bookkeeping, kept at the end of the OS region
+#define SEG_CLASSES 16                          // Size class c holds free blocks of 2^c to 2^(c+1)-1 words
+#define SEG_HEADS (OS_MEM_SIZE - SEG_CLASSES)   // Free-list head of each size class
+#define SEG_NONEMPTY (SEG_HEADS - 1)            // Bit c is set while size class c has a free block
+#define SEG_MIN_FREE 2                          // Free blocks need room for the prev pointer and the footer
+
+//  Paging: memory above the OS region is split into page frames, and each process has a page table
+//  in one frame with an entry per page of its code segment followed by one per page of its heap
+#define PAGE_SHIFT 8                                // 256-word pages, so frame f starts at f << PAGE_SHIFT
+#define PAGE_WORDS (1 << PAGE_SHIFT)
+#define SEG_PAGES (0x1000 >> PAGE_SHIFT)            // pages per segment
+#define PTE_PRESENT 0x100                           // a page table entry is PTE_PRESENT | frame, 0 when unmapped
+#define PF_FREE (HEAP_TOUCHED + MAX_PROC_COUNT)     // first free page frame, 0 when none is left
+
+//  PID recycling
+#define PID_FREE (PF_FREE + 1)      // first pid of the free-PID list, linked through RQ_NEXT, 0xFFFF when empty
+#define ALLOC_ROVER (PID_FREE + 1)  // free block where the next-fit search resumes
+
+_Static_assert(ALLOC_ROVER < SEG_NONEMPTY, "OS region bookkeeping overlaps");
 //New OS declarations
 
-
-bool running = true;
+// VM options, read from the environment by initOS()
+//  VM_ALLOC=firstfit|nextfit|bestfit|segfit   placement policy of allocMem()/freeMem()
+//   next fit and best fit only change how allocMem() searches the first-fit free list
+enum alloc_policy { ALLOC_FIRST_FIT = 0, ALLOC_SEGFIT, ALLOC_NEXT_FIT, ALLOC_BEST_FIT };
+const char *allocPolicyNames[] = { "firstfit", "segfit", "nextfit", "bestfit" };
+enum alloc_policy allocPolicy = ALLOC_FIRST_FIT;
+//  VM_QUANTUM=n               preempt after n instructions at level 0 (doubling per level), 0 = only tyld switches
+//  VM_LEVELS=n                number of MLFQ levels, 1 to MLFQ_MAX_LEVELS
+//  VM_BOOST=n                 move every process back to level 0 every n instructions, counted over all CPUs
+uint32_t mlfqQuantum = 0;
+uint16_t mlfqLevels = 1;
+uint64_t mlfqBoost = 0;
+//  VM_LAZY_HEAP=1             zero heap words past the loaded image on first touch instead of leaving stale data
+//                             and give each heap only the block its image needs, grown when the guest touches past it
+bool lazyHeap = false;
+VM_LOCAL uint32_t mlfqSliceLeft = 0;   // instructions left in the running process's time slice
+uint64_t mlfqSinceBoost = 0;           // instructions run by all CPUs since the last priority boost, under the OS lock
+VM_LOCAL uint32_t mlfqBoostPending = 0; // instructions of this CPU not yet added to mlfqSinceBoost
+#define MLFQ_BOOST_BATCH 256            // with several CPUs, instructions each one runs between taking the OS lock to count them
+uint64_t switchCount = 0;       // context switches done by switchProc()
+uint64_t switchNanos = 0;       // time spent in those switches
+uint64_t tbrkFailures = 0;      // tbrk calls that left the heap bound short of (or past) R0
+//  VM_COMPACT=1               when tbrk cannot grow a heap in place, move it, compacting memory if needed;
+//                             a copy-on-write code copy that does not fit also compacts memory
+//  VM_COMPACT_FRAG=p          also compact after thalt once more than p percent of free memory is fragmented
+bool compactOnTbrk = false;
+int compactFrag = 0;
+//  VM_STRICT_IO=1             write every guest character through immediately and read input with stdio
+bool strictIO = false;
+//  VM_CPUS=n                  number of virtual CPUs, only in -DVM_SMP builds
+int vmCpus = 1;
+//  VM_PAGING=1                translate through per-process page tables instead of segment base and bound
+bool pagingMode = false;
+uint16_t framesUsed = 0;        // page frames mapped by every process
+uint16_t framesPeak = 0;        // most page frames mapped at once
+//  VM_FREE_REPORT=n           print free memory statistics every n context switches, and warn as soon as a
+//                             switch finds no free block large enough for another process
+uint64_t freeReportEvery = 0;
+uint64_t freeSamples = 0;       // context switches that sampled the free memory
+uint16_t freeLowest = 0xFFFF;   // smallest largest-free-block seen by those samples
+bool freeAlerted = false;       // the last sample was already too small for a new process
+//  VM_RESTORE=file            start run() from a snapshot, createProc() and loadProc() do nothing before it
+//  VM_CHECKPOINT=file         snapshot the VM when run() starts, after any restore
+char *restorePath = NULL;       // snapshot picked by initOS() for the next run()
+
+
+VM_LOCAL bool running = true;
+VM_LOCAL uint16_t curProc = 0xFFFF;    // pid running on this CPU, mirrored in mem[Cur_Proc_ID]
 
 typedef void (*op_ex_f)(uint16_t i);
 typedef void (*trp_ex_f)();
@@ -59,8 +166,10 @@ enum { trp_offset = 0x20 };
 enum regist { R0 = 0, R1, R2, R3, R4, R5, R6, R7, RPC, RCND, RBSC, RBDC, RBSH, RBDH, RCNT };
 enum flags { FP = 1 << 0, FZ = 1 << 1, FN = 1 << 2 };
 
-uint16_t mem[UINT16_MAX] = {0};
-uint16_t reg[RCNT] = {0};
+#define SNAP_MEM_OFFSET 16384 // mem starts this far into a snapshot file, a multiple of the host page size
+uint16_t mem[UINT16_MAX + 1] __attribute__((aligned(SNAP_MEM_OFFSET))) = {0}; // aligned so a snapshot can be mapped over it
+VM_LOCAL uint16_t reg[RCNT] = {0};
+uint16_t procRegs[MAX_PROC_COUNT][RPC + 1]; // R0-R7 and the condition codes of preempted processes
 uint16_t PC_START = 0x3000;
 
 void initOS();
@@ -74,6 +183,259 @@ static inline void mw(uint16_t address, uint16_t val);
 static inline void tbrk();
 static inline void thalt();
 static inline void trap(uint16_t i);
+static inline bool mlfqTick();
+void tbrkLocked();
+bool heapGrowsInPlace(uint16_t newSize);
+void heapResizeBlock(uint16_t newSize);
+bool relocateHeap(uint16_t newSize);
+uint16_t rqTake(bool take);
+void rqRemove(uint16_t pid);
+bool vmCheckpoint(const char *path);
+bool vmRestore(const char *path);
+
+// Free memory statistics, gathered by freeStats() in one walk of the free list(s)
+#define FREE_HIST_BUCKETS 16    // bucket b counts free blocks of 2^b to 2^(b+1)-1 words, as the segfit size classes do
+typedef struct {
+    uint32_t total;             // free words, not counting block headers
+    uint16_t largest;           // words in the largest free block
+    uint16_t blocks;            // free blocks holding at least one word
+    uint16_t hist[FREE_HIST_BUCKETS];
+} vm_freestats;
+
+void freeStats(vm_freestats *s);
+double freeFragPct(const vm_freestats *s);
+void freeReport(const char *when, const vm_freestats *s);
+void freeSample();
+
+// OS lock: serialises every virtual CPU's access to the OS region (PCBs, run queue, free list)
+#ifdef VM_SMP
+pthread_mutex_t osMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t osReady = PTHREAD_COND_INITIALIZER; // signalled when a process becomes ready or the last one halts
+#define osLock() pthread_mutex_lock(&osMutex)
+#define osUnlock() pthread_mutex_unlock(&osMutex)
+#else
+#define osLock() ((void)0)
+#define osUnlock() ((void)0)
+#endif
+
+// Profiling: build with -DVM_PROFILE to count where guest time goes; PROF() compiles to nothing otherwise.
+// Counters are per CPU and summed into profTotal when the CPU stops; run() dumps them as JSON to
+// the file named by VM_PROFILE_OUT, or to stderr.
+#ifdef VM_PROFILE
+typedef struct {
+    uint64_t ops[NOPS];                     // executions per opcode
+    uint64_t traps[NTRP];                   // executions per trap
+    uint64_t pidIns[MAX_PROC_COUNT];        // instructions per pid
+    uint64_t pidSwitches[MAX_PROC_COUNT];   // times each pid was switched out
+    uint64_t allocCalls, freeCalls;         // allocMem()/freeMem() calls
+    uint64_t allocWalk, freeWalk;           // free-list blocks visited by allocation and by free/coalesce/tbrk
+    uint64_t faults;                        // segmentation faults
+} vm_profile;
+
+VM_LOCAL vm_profile prof;
+vm_profile profTotal;
+#define PROF(x) (x)
+#else
+#define PROF(x) ((void)0)
+#endif
+
+// Execution traces: build with -DVM_TRACE, then set VM_TRACE_OUT=file to record a run or VM_REPLAY=file to
+// replay it. Replay feeds the recorded input to the input traps and stops at the first event that differs.
+// Records are a tag byte and LEB128 varints. Only control transfers store a PC, together with the number
+// of instructions run since the previous one, so straight-line code costs a compare per instruction.
+#ifdef VM_TRACE
+enum trace_tag { EV_JUMP = 1, EV_INPUT, EV_SWITCH, EV_ALLOC, EV_FREE, EV_END, EV_REPEAT };
+const char *traceTagNames[] = { "eof", "jump", "input", "switch", "alloc", "free", "end", "repeat" };
+#define TRACE_MAGIC "LC3TRC1"
+#define TRACE_BUF_SIZE 65536
+
+FILE *traceFile = NULL;         // trace being recorded or replayed, NULL when tracing is off
+bool traceReplay = false;
+uint8_t traceBuf[TRACE_BUF_SIZE]; // records waiting to be written, or read ahead of replay
+size_t tracePos = 0, traceLen = 0;
+uint16_t traceNext = 0;         // PC expected if the next instruction follows the previous one
+uint64_t traceIns = 0;          // instructions fetched so far
+uint64_t traceMark = 0;         // value of traceIns at the last control transfer
+uint64_t traceLastRun = 0;      // instruction count and PC of the last jump record
+uint16_t traceLastPc = 0;
+uint64_t traceRepeats = 0;      // repeats of that jump not yet written, or not yet seen in replay
+
+void outFlush();
+
+static inline void tracePutByte(uint8_t b) {
+    traceBuf[tracePos++] = b;
+    if (tracePos == TRACE_BUF_SIZE) {
+        fwrite(traceBuf, 1, tracePos, traceFile);
+        tracePos = 0;
+    }
+}
+
+static inline int traceGetByte() {
+    if (tracePos == traceLen) {
+        traceLen = fread(traceBuf, 1, TRACE_BUF_SIZE, traceFile);
+        tracePos = 0;
+        if (traceLen == 0) return EOF;
+    }
+    return traceBuf[tracePos++];
+}
+
+static inline int tracePeekByte() {
+    int c = traceGetByte();
+    if (c != EOF) tracePos--;
+    return c;
+}
+
+void tracePutVar(uint64_t v) {
+    while (v >= 0x80) {
+        tracePutByte((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    tracePutByte((uint8_t)v);
+}
+
+uint64_t traceGetVar() {
+    uint64_t v = 0;
+    int c;
+    for (int shift = 0; (c = traceGetByte()) != EOF; shift += 7) {
+        v |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) break;
+    }
+    return v;
+}
+
+void traceDiverged(const char *traced, uint64_t ta, uint64_t tb, const char *seen, uint64_t a, uint64_t b) {
+    outFlush();
+    fflush(stdout);
+    fprintf(stderr, "Replay diverged after %llu instructions: %s (%llu, %llu) in the trace, %s (%llu, %llu) in this run.\n",
+            (unsigned long long)traceIns, traced, (unsigned long long)ta, (unsigned long long)tb,
+            seen, (unsigned long long)a, (unsigned long long)b);
+    exit(1);
+}
+
+// Write out the repeats of the last jump that are still only counted
+void traceFlushRepeats() {
+    if (traceRepeats > 0) {
+        tracePutByte(EV_REPEAT);
+        tracePutVar(traceRepeats);
+        tracePutVar(0);
+        traceRepeats = 0;
+    }
+}
+
+// Record an event, or check it against the trace when replaying
+void traceEvent(uint8_t tag, uint64_t a, uint64_t b) {
+    if (!traceReplay) {
+        traceFlushRepeats();
+        tracePutByte(tag);
+        tracePutVar(a);
+        tracePutVar(b);
+        return;
+    }
+    if (traceRepeats > 0) {
+        traceDiverged("jump", traceLastRun, traceLastPc, traceTagNames[tag], a, b);
+    }
+    int t = traceGetByte();
+    uint64_t ta = traceGetVar(), tb = traceGetVar();
+    if (t != tag || ta != a || tb != b) {
+        traceDiverged(traceTagNames[t >= EV_JUMP && t <= EV_REPEAT ? t : 0], ta, tb, traceTagNames[tag], a, b);
+    }
+}
+
+// Record a control transfer. A loop repeats the same one, so runs of identical jumps are stored as a count.
+void traceJump(uint64_t run, uint16_t pc) {
+    bool same = run == traceLastRun && pc == traceLastPc;
+    if (!traceReplay) {
+        if (same) {
+            traceRepeats++;
+            return;
+        }
+        traceEvent(EV_JUMP, run, pc);
+    }
+    else if (traceRepeats > 0) {
+        if (!same) traceDiverged("jump", traceLastRun, traceLastPc, "jump", run, pc);
+        traceRepeats--;
+        return;
+    }
+    else if (same && tracePeekByte() == EV_REPEAT) {
+        traceGetByte();
+        traceRepeats = traceGetVar() - 1;
+        traceGetVar();
+        return;
+    }
+    else {
+        traceEvent(EV_JUMP, run, pc);
+    }
+    traceLastRun = run;
+    traceLastPc = pc;
+}
+
+static inline void tracePc(uint16_t pc) {
+    traceIns++;
+    if (pc != traceNext) {
+        traceJump(traceIns - traceMark, pc);
+        traceMark = traceIns;
+    }
+    traceNext = pc + 1;
+}
+
+// Return the next recorded input value in *value, or false when not replaying
+bool traceInput(uint16_t *value) {
+    if (!traceReplay) return false;
+    if (traceRepeats > 0) traceDiverged("jump", traceLastRun, traceLastPc, "input", 0, 0);
+    int t = traceGetByte();
+    uint64_t a = traceGetVar();
+    traceGetVar();
+    if (t != EV_INPUT) {
+        traceDiverged(traceTagNames[t >= EV_JUMP && t <= EV_REPEAT ? t : 0], a, 0, "input", 0, 0);
+    }
+    *value = (uint16_t)a;
+    return true;
+}
+
+// Start recording or replaying as the environment asks. Traces assume a single virtual CPU.
+void traceOpen() {
+    char *path;
+    char magic[8] = TRACE_MAGIC;
+    if ((path = getenv("VM_REPLAY")) != NULL) {
+        traceFile = fopen(path, "rb");
+        traceReplay = true;
+        if (traceFile != NULL && (fread(magic, 1, sizeof(magic), traceFile) != sizeof(magic) ||
+                                  memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)) {
+            fprintf(stderr, "%s is not a VM trace.\n", path);
+            exit(1);
+        }
+    }
+    else if ((path = getenv("VM_TRACE_OUT")) != NULL) {
+        traceFile = fopen(path, "wb");
+        if (traceFile != NULL) fwrite(magic, 1, sizeof(magic), traceFile);
+    }
+    else {
+        return;
+    }
+    if (traceFile == NULL) {
+        fprintf(stderr, "Cannot open file %s.\n", path);
+        exit(1);
+    }
+    traceNext = PC_START; // A first process starting at PC_START stores no jump
+}
+
+// End the trace with the instructions run since the last control transfer
+void traceClose() {
+    if (traceFile == NULL) return;
+    traceEvent(EV_END, traceIns - traceMark, 0);
+    if (!traceReplay) fwrite(traceBuf, 1, tracePos, traceFile);
+    fclose(traceFile);
+    traceFile = NULL;
+}
+
+#define TRACE(x) do { if (traceFile != NULL) x; } while (0)
+#define TRACE_INPUT(v) traceInput(v)
+#define TRACE_ACTIVE() (traceFile != NULL)
+#else
+#define TRACE(x) ((void)0)
+#define TRACE_INPUT(v) false
+#define TRACE_ACTIVE() false
+#endif
 
 static inline uint16_t sext(uint16_t n, int b) { return ((n>>(b-1))&1) ? (n|(0xFFFF << b)) : n; }
 static inline void uf(enum regist r) {
@@ -86,7 +448,7 @@ static inline void and(uint16_t i)  { reg[DR(i)] = reg[SR1(i)] & (FIMM(i) ? SEXT
 static inline void ldi(uint16_t i)  { reg[DR(i)] = mr(mr(reg[RPC]+POFF9(i))); uf(DR(i)); }
 static inline void not(uint16_t i)  { reg[DR(i)]=~reg[SR1(i)]; uf(DR(i)); }
 static inline void br(uint16_t i)   { if (reg[RCND] & FCND(i)) { reg[RPC] += POFF9(i); } }
-static inline void jsr(uint16_t i)  { reg[R7] = reg[RPC]; reg[RPC] = (FL(i)) ? reg[RPC] + POFF11(i) : reg[BR(i)]; }
+static inline void jsr(uint16_t i)  { uint16_t t = (FL(i)) ? reg[RPC] + POFF11(i) : reg[BR(i)]; reg[R7] = reg[RPC]; reg[RPC] = t; } // JSRR R7 jumps to the old R7
 static inline void jmp(uint16_t i)  { reg[RPC] = reg[BR(i)]; }
 static inline void ld(uint16_t i)   { reg[DR(i)] = mr(reg[RPC] + POFF9(i)); uf(DR(i)); }
 static inline void ldr(uint16_t i)  { reg[DR(i)] = mr(reg[SR1(i)] + POFF(i)); uf(DR(i)); }
@@ -96,43 +458,603 @@ static inline void sti(uint16_t i)  { mw(mr(reg[RPC] + POFF9(i)), reg[DR(i)]); }
 static inline void str(uint16_t i)  { mw(reg[SR1(i)] + POFF(i), reg[DR(i)]); }
 static inline void rti(uint16_t i) {} // unused
 static inline void res(uint16_t i) {} // unused
-static inline void tgetc() { reg[R0] = getchar(); }
-static inline void tout() { fprintf(stdout, "%c", (char)reg[R0]); }
+
+// Console I/O
+//  Guest output collects in a per-CPU buffer that is written out on newline, when full, and
+//  whenever the process leaves the CPU, so it always holds the output of a single process.
+//  Guest input is read from stdin in blocks.
+#define OUTBUF_SIZE 256
+#define INBUF_SIZE 4096
+
+VM_LOCAL char outBuf[OUTBUF_SIZE];
+VM_LOCAL int outLen = 0;
+
+char inBuf[INBUF_SIZE];
+int inPos = 0, inLen = 0;
+
+#ifdef VM_SMP
+pthread_mutex_t inMutex = PTHREAD_MUTEX_INITIALIZER; // Input traps of different CPUs share inBuf
+#define inLock() pthread_mutex_lock(&inMutex)
+#define inUnlock() pthread_mutex_unlock(&inMutex)
+#else
+#define inLock() ((void)0)
+#define inUnlock() ((void)0)
+#endif
+
+// Write out the buffered guest output of this CPU
+void outFlush() {
+    if (outLen > 0) {
+        fwrite(outBuf, 1, outLen, stdout);
+        outLen = 0;
+    }
+}
+
+static inline void outPut(char c) {
+    if (strictIO) {
+        fputc(c, stdout);
+        fflush(stdout);
+        return;
+    }
+    outBuf[outLen++] = c;
+    if (c == '\n' || outLen == OUTBUF_SIZE) outFlush();
+}
+
+// Return the next input character, or EOF
+static inline int inGet() {
+    if (strictIO) return getchar();
+    if (inPos == inLen) {
+        outFlush(); // A prompt must be visible before blocking on input
+        fflush(stdout);
+        ssize_t n = read(STDIN_FILENO, inBuf, INBUF_SIZE);
+        if (n <= 0) return EOF;
+        inPos = 0;
+        inLen = n;
+    }
+    return (unsigned char)inBuf[inPos++];
+}
+
+static inline void tgetc() {
+    if (TRACE_INPUT(&reg[R0])) return;
+    inLock(); reg[R0] = inGet(); inUnlock();
+    TRACE(traceEvent(EV_INPUT, reg[R0], 0));
+}
+static inline void tout() { outPut((char)reg[R0]); }
 static inline void tputs() {
     uint16_t *p = mem + reg[R0];
     while(*p) {
-        fprintf(stdout, "%c", (char)*p);
+        outPut((char)*p);
         p++;
     }
 }
-static inline void tin() { reg[R0] = getchar(); fprintf(stdout, "%c", reg[R0]); }
+static inline void tin() {
+    if (!TRACE_INPUT(&reg[R0])) {
+        inLock(); reg[R0] = inGet(); inUnlock();
+        TRACE(traceEvent(EV_INPUT, reg[R0], 0));
+    }
+    outPut((char)reg[R0]);
+}
 static inline void tputsp() { /* Not Implemented */ }
 
-static inline void tinu16() { fscanf(stdin, "%hu", &reg[R0]); }
-static inline void toutu16() { fprintf(stdout, "%hu\n", reg[R0]); }
+static inline void tinu16() {
+    if (TRACE_INPUT(&reg[R0])) return;
+    if (strictIO) {
+        fscanf(stdin, "%hu", &reg[R0]);
+        TRACE(traceEvent(EV_INPUT, reg[R0], 0));
+        return;
+    }
+
+    // Same as scanf("%hu"): skip blanks, then read decimal digits
+    inLock();
+    int c = inGet();
+    while (c != EOF && isspace(c)) c = inGet();
+    if (c != EOF && isdigit(c)) {
+        uint16_t v = 0;
+        while (c != EOF && isdigit(c)) {
+            v = v * 10 + (c - '0');
+            c = inGet();
+        }
+        reg[R0] = v;
+    }
+    if (c != EOF) inPos--; // Leave the character after the number for the next read
+    inUnlock();
+    TRACE(traceEvent(EV_INPUT, reg[R0], 0)); // R0 is unchanged when no number was read
+}
+static inline void toutu16() {
+    char digits[6];
+    int n = 0;
+    uint16_t v = reg[R0];
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) outPut(digits[--n]);
+    outPut('\n');
+}
 
 
-trp_ex_f trp_ex[10] = { tgetc, tout, tputs, tin, tputsp, thalt, tinu16, toutu16, tyld, tbrk };
-static inline void trap(uint16_t i) { trp_ex[TRP(i)-trp_offset](); }
+trp_ex_f trp_ex[NTRP] = { tgetc, tout, tputs, tin, tputsp, thalt, tinu16, toutu16, tyld, tbrk };
+static inline void trap(uint16_t i) { PROF(prof.traps[TRP(i)-trp_offset]++); trp_ex[TRP(i)-trp_offset](); }
 op_ex_f op_ex[NOPS] = { /*0*/ br, add, ld, st, jsr, and, ldr, str, rti, not, ldi, sti, jmp, res, lea, trap };
 
-void ld_img(char *fname, uint16_t offset, uint16_t size) {
+// Decoded instruction cache
+//  Build with -DVM_DECODE_CACHE to fetch through the cache, or -DVM_THREADED_DISPATCH to
+//  additionally replace the op_ex table with a computed-goto loop (implies the cache).
+//  Build with -DVM_FUSE to also fuse common instruction sequences into superinstructions (implies both).
+//  Build with -DVM_REPORT_IPS to print guest instructions per second when run() returns.
+#ifdef VM_FUSE
+#ifndef VM_THREADED_DISPATCH
+#define VM_THREADED_DISPATCH
+#endif
+#endif
+#ifdef VM_THREADED_DISPATCH
+#ifndef VM_DECODE_CACHE
+#define VM_DECODE_CACHE
+#endif
+#endif
+
+#ifdef VM_DECODE_CACHE
+#define DCACHE_SLOTS 4          // number of code segments cached at the same time
+#define DCACHE_WORDS 4096       // words per slot, one per possible code segment offset
+#define DCACHE_NO_BASE 0xFFFF   // base value of an unused slot
+
+typedef struct {
+    uint32_t gen;   // generation the entry was decoded in, valid only if equal to its slot's generation
+    uint16_t raw;   // original instruction word
+    uint16_t imm;   // sign-extended immediate, PC offset or trap vector
+    uint16_t imm2;  // immediate of the second instruction of a superinstruction
+    uint8_t op;     // opcode
+    uint8_t dr;     // destination register, or condition bits for BR
+    uint8_t sr1;    // first source register, or base register for JMP/JSRR
+    uint8_t sr2;    // second source register
+    uint8_t fimm;   // immediate flag for ADD/AND, long offset flag for JSR
+} dins;
+
+typedef struct {
+    uint16_t base;  // physical base of the cached code segment
+    uint32_t gen;   // current generation of the slot
+    dins ins[DCACHE_WORDS];
+} dslot;
+
+VM_LOCAL dslot dcache[DCACHE_SLOTS];
+VM_LOCAL dslot *dcacheCur = NULL; // slot of the code segment that is currently executing
+VM_LOCAL uint32_t dcacheGen = 0;  // last generation handed out
+VM_LOCAL int dcacheVictim = 0;    // next slot to be replaced
+
+#ifdef VM_SMP
+// Every CPU has its own cache, so an invalidation on one CPU also bumps this shared epoch. A CPU that
+// finds the epoch changed drops all its decodes before using the cache again (see dcacheSync()).
+uint32_t dcacheEpoch = 0;
+VM_LOCAL uint32_t dcacheSeen = 0; // epoch this CPU's cache is up to date with
+
+// Tell the other CPUs that code changed, without making this CPU drop its own, already updated cache
+static inline void dcacheBroadcast() {
+    if (__atomic_fetch_add(&dcacheEpoch, 1, __ATOMIC_RELEASE) == dcacheSeen) dcacheSeen++;
+}
+
+// Drop every cached decode if another CPU changed code since this CPU last looked
+static inline void dcacheSync() {
+    uint32_t epoch = __atomic_load_n(&dcacheEpoch, __ATOMIC_ACQUIRE);
+    if (epoch != dcacheSeen) {
+        for (int s = 0; s < DCACHE_SLOTS; s++) {
+            dcache[s].gen = ++dcacheGen;
+        }
+        dcacheSeen = epoch;
+    }
+}
+#else
+#define dcacheBroadcast() ((void)0)
+#define dcacheSync() ((void)0)
+#endif
+
+// Re-decode every cached code segment that overlaps the physical range [addr, addr + size)
+void dcacheInvalidate(uint16_t addr, uint32_t size) {
+    for (int s = 0; s < DCACHE_SLOTS; s++) {
+        uint32_t base = dcache[s].base;
+        if (dcache[s].base != DCACHE_NO_BASE && base < addr + size && addr < base + DCACHE_WORDS) {
+            dcache[s].gen = ++dcacheGen;
+        }
+    }
+    dcacheBroadcast();
+}
+
+// Drop a single cached instruction after the guest writes into its code segment
+static inline void dcacheInvalidateWord(uint16_t offset) {
+    dcacheBroadcast();
+    for (int s = 0; s < DCACHE_SLOTS; s++) {
+        if (dcache[s].base == reg[RBSC]) {
+            dcache[s].ins[offset].gen = 0;
+#ifdef VM_FUSE
+            // Superinstructions starting up to two words earlier may include this one
+            if (offset >= 1) dcache[s].ins[offset - 1].gen = 0;
+            if (offset >= 2) dcache[s].ins[offset - 2].gen = 0;
+#endif
+        }
+    }
+}
+
+// Return the cache slot for the code segment at the given base, claiming one if needed
+static inline dslot *dcacheSlot(uint16_t base) {
+    for (int s = 0; s < DCACHE_SLOTS; s++) {
+        if (dcache[s].base == base) return &dcache[s];
+    }
+    dslot *slot = &dcache[dcacheVictim];
+    dcacheVictim = (dcacheVictim + 1) % DCACHE_SLOTS;
+    slot->base = base;
+    slot->gen = ++dcacheGen; // Every older entry in the slot becomes stale
+    return slot;
+}
+
+// Split an instruction word into its fields once
+static inline void decode(dins *d, uint16_t i) {
+    d->raw = i;
+    d->op = OPC(i);
+    d->dr = DR(i);
+    d->sr1 = SR1(i);
+    d->sr2 = SR2(i);
+    d->fimm = FIMM(i);
+    switch (d->op) {
+        case 1: case 5: d->imm = SEXTIMM(i); break;        // ADD, AND
+        case 4: d->fimm = FL(i); d->sr1 = BR(i); d->imm = POFF11(i); break; // JSR, JSRR
+        case 6: case 7: d->imm = POFF(i); break;           // LDR, STR
+        case 12: d->sr1 = BR(i); d->imm = 0; break;        // JMP
+        case 15: d->imm = TRP(i); break;                   // TRAP
+        default: d->imm = POFF9(i); break;                 // BR, LD, ST, LDI, STI, LEA
+    }
+}
+
+#ifdef VM_FUSE
+// Superinstructions, each standing for a straight-line run of instructions that always execute together
+enum {
+    OP_ADD_BR = NOPS,   // ADD Rd, Rs, #imm; BR cc, off: loop counters (sr2 = BR condition, imm2 = BR offset)
+    OP_LD_ADD_ST,       // LD Rd, x; ADD Rd, Rs, y; ST Rd, x: counters in memory (sr1/sr2/fimm/imm2 = ADD fields)
+    OP_LEA_TRAP,        // LEA R0, s; TRAP PUTS or PUTSP: printing a string (imm2 = trap vector)
+    NFUSED
+};
+
+// Decode the instruction at w, fusing it with the following ones when they form a known idiom
+// that lies entirely within the avail words left in the code segment
+static inline void decodeFused(dins *d, uint16_t *w, int avail) {
+    decode(d, w[0]);
+    if (mlfqQuantum != 0 || TRACE_ACTIVE()) {
+        return; // A time slice may end between two fused instructions, and traces count every instruction
+    }
+
+    if (avail >= 2 && d->op == 1 && d->fimm && OPC(w[1]) == 0) {
+        d->op = OP_ADD_BR;
+        d->sr2 = FCND(w[1]);
+        d->imm2 = POFF9(w[1]);
+    }
+    else if (avail >= 2 && d->op == 14 && d->dr == R0 && (w[1] == 0xF022 || w[1] == 0xF024)) {
+        d->op = OP_LEA_TRAP;
+        d->imm2 = TRP(w[1]);
+    }
+    else if (avail >= 3 && d->op == 2 && OPC(w[1]) == 1 && DR(w[1]) == d->dr &&
+             OPC(w[2]) == 3 && DR(w[2]) == d->dr && POFF9(w[2]) == (uint16_t)(d->imm - 2)) {
+        d->op = OP_LD_ADD_ST; // The ST is two words further on, so the same offset minus two hits the same word
+        d->sr1 = SR1(w[1]);
+        d->sr2 = SR2(w[1]);
+        d->fimm = FIMM(w[1]);
+        d->imm2 = SEXTIMM(w[1]);
+    }
+}
+#endif
+
+// Fetch the instruction at reg[RPC] through the cache and advance the PC
+static inline dins *fetchDecoded() {
+    static VM_LOCAL dins scratch; // Per CPU, every virtual CPU decodes into its own
+    uint16_t pc = reg[RPC]++;
+    uint16_t offset = pc & 0x0FFF;
+
+    // Anything outside the code segment takes the checked path so faults are still reported.
+    // Paged code is not contiguous in memory, so it is never cached.
+    if (pagingMode || (pc >> 12) != 0x3 || offset > reg[RBDC]) {
+        decode(&scratch, mr(pc));
+        return &scratch;
+    }
+
+    dcacheSync();
+    if (dcacheCur == NULL || dcacheCur->base != reg[RBSC]) {
+        dcacheCur = dcacheSlot(reg[RBSC]);
+    }
+
+    dins *d = &dcacheCur->ins[offset];
+    if (d->gen != dcacheCur->gen) {
+        decode(d, mem[reg[RBSC] + offset]);
+        d->gen = dcacheCur->gen;
+    }
+    return d;
+}
+#endif
+
+// Load an image file into memory and return the number of words read
+size_t ld_img(char *fname, uint16_t offset, uint16_t size) {
     FILE *in = fopen(fname, "rb");
     if (NULL==in) {
         fprintf(stderr, "Cannot open file %s.\n", fname);
         exit(1);    
     }
     uint16_t *p = mem + offset;
-    fread(p, sizeof(uint16_t), (size), in);
+    size_t n = fread(p, sizeof(uint16_t), (size), in);
     fclose(in);
+#ifdef VM_DECODE_CACHE
+    dcacheInvalidate(offset, size); // Stale decodes of whatever was loaded here before
+#endif
+    return n;
 }
 
-void run(char* code, char* heap) {
+// Read an image file into a zeroed host buffer and return the number of words read
+size_t readImage(char *fname, uint16_t *words, uint16_t size) {
+    FILE *in = fopen(fname, "rb");
+    if (NULL==in) {
+        fprintf(stderr, "Cannot open file %s.\n", fname);
+        exit(1);    
+    }
+    memset(words, 0, size * sizeof(uint16_t));
+    size_t n = fread(words, sizeof(uint16_t), size, in);
+    fclose(in);
+    return n;
+}
 
+#ifdef VM_REPORT_IPS
+VM_LOCAL uint64_t executed = 0;     // instructions executed by this CPU
+uint64_t executedTotal = 0;         // instructions executed by every CPU that has stopped
+#endif
+
+// Execute guest instructions on this CPU until it runs out of processes
+void cpuLoop() {
+#ifdef VM_REPORT_IPS
+#define COUNT_INS() (executed++)
+#define COUNT_MORE(n) (executed += (n))
+#else
+#define COUNT_INS() ((void)0)
+#define COUNT_MORE(n) ((void)0)
+#endif
+
+#if defined(VM_THREADED_DISPATCH)
+#ifdef VM_FUSE
+    static void *labels[NFUSED] = {
+        &&op_br, &&op_add, &&op_ld, &&op_st, &&op_jsr, &&op_and, &&op_ldr, &&op_str,
+        &&op_rti, &&op_not, &&op_ldi, &&op_sti, &&op_jmp, &&op_res, &&op_lea, &&op_trap,
+        &&op_add_br, &&op_ld_add_st, &&op_lea_trap
+    };
+#define DECODE(d, off) decodeFused(d, mem + slot->base + (off), limit - (off) + 1)
+#else
+    static void *labels[NOPS] = {
+        &&op_br, &&op_add, &&op_ld, &&op_st, &&op_jsr, &&op_and, &&op_ldr, &&op_str,
+        &&op_rti, &&op_not, &&op_ldi, &&op_sti, &&op_jmp, &&op_res, &&op_lea, &&op_trap
+    };
+#define DECODE(d, off) decode(d, mem[slot->base + (off)])
+#endif
+    dins *d;
+    dslot *slot = NULL; // Code segment state only changes inside traps, so it is kept in locals
+    int limit = -1; // Last valid code offset, -1 to fetch everything through fetchDecoded()
+
+#define REFRESH() do { \
+        dcacheSync(); \
+        dcacheCur = slot = dcacheSlot(reg[RBSC]); \
+        limit = pagingMode ? -1 : reg[RBDC] > 0x0FFF ? 0x0FFF : reg[RBDC]; \
+    } while (0)
+#define CODE_MOVED() do { if (slot->base != reg[RBSC]) REFRESH(); } while (0) // after a copy-on-write
+#define DISPATCH() do { \
+        COUNT_INS(); \
+        if (mlfqQuantum != 0 && mlfqTick()) REFRESH(); \
+        TRACE(tracePc(reg[RPC])); \
+        uint16_t off = (uint16_t)(reg[RPC]++ - 0x3000); \
+        if ((int)off > limit) { reg[RPC]--; d = fetchDecoded(); } \
+        else if ((d = &slot->ins[off])->gen != slot->gen) { DECODE(d, off); d->gen = slot->gen; } \
+        PROF(prof.ops[OPC(d->raw)]++); \
+        PROF(prof.pidIns[curProc]++); \
+        goto *labels[d->op]; \
+    } while (0)
+
+    if (!running) goto done;
+    REFRESH();
+    DISPATCH();
+op_br:   if (reg[RCND] & d->dr) { reg[RPC] += d->imm; } DISPATCH();
+op_add:  reg[d->dr] = reg[d->sr1] + (d->fimm ? d->imm : reg[d->sr2]); uf(d->dr); DISPATCH();
+op_ld:   reg[d->dr] = mr(reg[RPC] + d->imm); uf(d->dr); DISPATCH();
+op_st:   mw(reg[RPC] + d->imm, reg[d->dr]); CODE_MOVED(); DISPATCH();
+op_jsr:  { uint16_t t = d->fimm ? reg[RPC] + d->imm : reg[d->sr1]; reg[R7] = reg[RPC]; reg[RPC] = t; } DISPATCH();
+op_and:  reg[d->dr] = reg[d->sr1] & (d->fimm ? d->imm : reg[d->sr2]); uf(d->dr); DISPATCH();
+op_ldr:  reg[d->dr] = mr(reg[d->sr1] + d->imm); uf(d->dr); DISPATCH();
+op_str:  mw(reg[d->sr1] + d->imm, reg[d->dr]); CODE_MOVED(); DISPATCH();
+op_rti:  DISPATCH();
+op_not:  reg[d->dr] = ~reg[d->sr1]; uf(d->dr); DISPATCH();
+op_ldi:  reg[d->dr] = mr(mr(reg[RPC] + d->imm)); uf(d->dr); DISPATCH();
+op_sti:  mw(mr(reg[RPC] + d->imm), reg[d->dr]); CODE_MOVED(); DISPATCH();
+op_jmp:  reg[RPC] = reg[d->sr1]; DISPATCH();
+op_res:  DISPATCH();
+op_lea:  reg[d->dr] = reg[RPC] + d->imm; uf(d->dr); DISPATCH();
+op_trap: PROF(prof.traps[d->imm - trp_offset]++);
+         trp_ex[d->imm - trp_offset]();
+         if (!running) goto done;
+         REFRESH(); // The trap may have switched, grown or halted the process
+         DISPATCH();
+#ifdef VM_FUSE
+    // Superinstructions run their parts in order, so faults, condition codes and the PC come out as unfused
+#define FUSED(n) do { COUNT_MORE(n); PROF(prof.pidIns[curProc] += (n)); } while (0)
+op_add_br:   reg[d->dr] = reg[d->sr1] + d->imm; uf(d->dr);
+             reg[RPC]++; if (reg[RCND] & d->sr2) { reg[RPC] += d->imm2; }
+             FUSED(1); PROF(prof.ops[0]++);
+             DISPATCH();
+op_ld_add_st: { uint16_t addr = reg[RPC] + d->imm;
+             reg[d->dr] = mr(addr); uf(d->dr);
+             reg[d->dr] = reg[d->sr1] + (d->fimm ? d->imm2 : reg[d->sr2]); uf(d->dr);
+             reg[RPC] += 2; mw(addr, reg[d->dr]); CODE_MOVED(); }
+             FUSED(2); PROF(prof.ops[1]++); PROF(prof.ops[3]++);
+             DISPATCH();
+op_lea_trap: reg[d->dr] = reg[RPC] + d->imm; uf(d->dr);
+             reg[RPC]++;
+             FUSED(1); PROF(prof.ops[15]++); PROF(prof.traps[d->imm2 - trp_offset]++);
+             trp_ex[d->imm2 - trp_offset]();
+             if (!running) goto done;
+             REFRESH();
+             DISPATCH();
+#undef FUSED
+#endif
+done:
+#undef DECODE
+#undef DISPATCH
+#undef CODE_MOVED
+#undef REFRESH
+#elif defined(VM_DECODE_CACHE)
+    while(running) {
+        COUNT_INS();
+        if (mlfqQuantum != 0) mlfqTick();
+        TRACE(tracePc(reg[RPC]));
+        dins *d = fetchDecoded();
+        PROF(prof.ops[d->op]++);
+        PROF(prof.pidIns[curProc]++);
+        op_ex[d->op](d->raw);
+    }
+#else
     while(running) {
+        COUNT_INS();
+        if (mlfqQuantum != 0) mlfqTick();
+        TRACE(tracePc(reg[RPC]));
         uint16_t i = mr(reg[RPC]++);
+        PROF(prof.ops[OPC(i)]++);
+        PROF(prof.pidIns[curProc]++);
         op_ex[OPC(i)](i);
     }
+#endif
+
+    outFlush();
+#ifdef VM_REPORT_IPS
+    osLock();
+    executedTotal += executed;
+    osUnlock();
+#endif
+#ifdef VM_PROFILE
+    osLock();
+    uint64_t *from = (uint64_t *)&prof, *to = (uint64_t *)&profTotal;
+    for (size_t k = 0; k < sizeof(vm_profile) / sizeof(uint64_t); k++) to[k] += from[k];
+    osUnlock();
+#endif
+#undef COUNT_INS
+#undef COUNT_MORE
+}
+
+#ifdef VM_PROFILE
+// Write the summed profile as JSON
+void profDump() {
+    static const char *opNames[NOPS] = { "br", "add", "ld", "st", "jsr", "and", "ldr", "str",
+                                         "rti", "not", "ldi", "sti", "jmp", "res", "lea", "trap" };
+    static const char *trpNames[NTRP] = { "tgetc", "tout", "tputs", "tin", "tputsp",
+                                          "thalt", "tinu16", "toutu16", "tyld", "tbrk" };
+    char *path = getenv("VM_PROFILE_OUT");
+    FILE *out = path != NULL ? fopen(path, "w") : stderr;
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open file %s.\n", path);
+        return;
+    }
+
+    fprintf(out, "{\n  \"opcodes\": {");
+    for (int k = 0; k < NOPS; k++) {
+        fprintf(out, "%s\"%s\": %llu", k ? ", " : "", opNames[k], (unsigned long long)profTotal.ops[k]);
+    }
+    fprintf(out, "},\n  \"traps\": {");
+    for (int k = 0; k < NTRP; k++) {
+        fprintf(out, "%s\"%s\": %llu", k ? ", " : "", trpNames[k], (unsigned long long)profTotal.traps[k]);
+    }
+    fprintf(out, "},\n  \"processes\": [");
+    for (int pid = 0, first = 1; pid < MAX_PROC_COUNT; pid++) {
+        if (profTotal.pidIns[pid] == 0 && profTotal.pidSwitches[pid] == 0) continue;
+        fprintf(out, "%s\n    {\"pid\": %d, \"instructions\": %llu, \"switches\": %llu}", first ? "" : ",", pid,
+                (unsigned long long)profTotal.pidIns[pid], (unsigned long long)profTotal.pidSwitches[pid]);
+        first = 0;
+    }
+    fprintf(out, "\n  ],\n  \"allocator\": {\"alloc_calls\": %llu, \"free_calls\": %llu, "
+                 "\"alloc_walk\": %llu, \"free_walk\": %llu},\n",
+            (unsigned long long)profTotal.allocCalls, (unsigned long long)profTotal.freeCalls,
+            (unsigned long long)profTotal.allocWalk, (unsigned long long)profTotal.freeWalk);
+    fprintf(out, "  \"segment_faults\": %llu\n}\n", (unsigned long long)profTotal.faults);
+
+    if (out != stderr) fclose(out);
+}
+#endif
+
+#ifdef VM_SMP
+uint16_t smpWaitForWork();
+
+// Body of virtual CPUs 1 to vmCpus - 1
+void *smpCpuMain(void *arg) {
+    osLock();
+    uint16_t pid = smpWaitForWork();
+    if (pid != 0xFFFF) loadProc(pid);
+    osUnlock();
+
+    if (pid != 0xFFFF) cpuLoop();
+    return NULL;
+}
+
+// Run the loaded process on this thread and every other ready process on vmCpus - 1 more threads
+void smpRun() {
+    pthread_t cpus[vmCpus];
+
+    osLock();
+    rqRemove(curProc); // Ready processes are the ones no CPU is running
+    osUnlock();
+
+    for (int c = 1; c < vmCpus; c++) {
+        pthread_create(&cpus[c], NULL, smpCpuMain, NULL);
+    }
+    cpuLoop();
+    for (int c = 1; c < vmCpus; c++) {
+        pthread_join(cpus[c], NULL);
+    }
+}
+#endif
+
+void run(char* code, char* heap) {
+    char *snap;
+    if (restorePath != NULL) {
+        // Anything the driver wrote since initOS() is replaced as well
+        if (!vmRestore(restorePath)) exit(1);
+        restorePath = NULL;
+    }
+    if ((snap = getenv("VM_CHECKPOINT")) != NULL) {
+        vmCheckpoint(snap);
+    }
+
+#ifdef VM_REPORT_IPS
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+#endif
+
+#ifdef VM_SMP
+    if (vmCpus > 1) smpRun();
+    else
+#endif
+    cpuLoop();
+
+#ifdef VM_REPORT_IPS
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "Executed %llu guest instructions in %.6f s (%.2f MIPS).\n",
+            (unsigned long long)executedTotal, elapsed, elapsed > 0 ? executedTotal / elapsed / 1e6 : 0.0);
+#endif
+    if (pagingMode) {
+        fprintf(stderr, "Page frames: %d in use at exit, %d at peak, %d words each.\n",
+                framesUsed, framesPeak, PAGE_WORDS);
+    }
+    if (freeReportEvery != 0) {
+        vm_freestats s;
+        freeStats(&s);
+        freeReport("at exit", &s);
+        fprintf(stderr, "Largest free block was down to %u words over %llu samples.\n",
+                freeLowest, (unsigned long long)freeSamples);
+    }
+    if ((mlfqQuantum != 0 || vmCpus > 1) && switchCount != 0) {
+        fprintf(stderr, "%llu context switches, %.1f ns per switch.\n",
+                (unsigned long long)switchCount, (double)switchNanos / switchCount);
+    }
+#ifdef VM_TRACE
+    traceClose();
+#endif
+#ifdef VM_PROFILE
+    profDump();
+#endif
 }
 
 
@@ -171,6 +1093,7 @@ uint16_t getFreePrevHeader(uint16_t header) {
     // Traverse the free list until finding the block just before the header
     while (getFreeNext(prevHeader) != 0 && getFreeNext(prevHeader) < header) {
         prevHeader = getFreeNext(prevHeader);
+        PROF(prof.freeWalk++);
     }
 
     return prevHeader; // Return the header address
@@ -209,6 +1132,7 @@ void coalescePrev(uint16_t header) {
         // Merge the two blocks by updating the size and next pointer of the previous block
         setHeader(prevHeader, getFreeSize(prevHeader) + getFreeSize(header) + 2, getFreeNext(header));
         setHeader(header, 0, 0); // Clear the current block's header
+        if (mem[ALLOC_ROVER] == header) mem[ALLOC_ROVER] = prevHeader; // Keep the next-fit rover on the list
     }
 }
 
@@ -221,6 +1145,7 @@ void coalesceNext(uint16_t header) {
         // Merge the two blocks by updating the size and next pointer of the current block
         setHeader(header, getFreeSize(header) + getFreeSize(nextHeader) + 2, getFreeNext(nextHeader));
         setHeader(nextHeader, 0, 0); // Clear the next block's header
+        if (mem[ALLOC_ROVER] == nextHeader) mem[ALLOC_ROVER] = header; // Keep the next-fit rover on the list
     }
 }
 
@@ -230,16 +1155,209 @@ void coalesce(uint16_t header) {
     coalescePrev(header); // Attempt to merge with the previous block
 }
 
+// Segregated-fit allocator
+//  Free blocks keep the usual [size, next] header and additionally store the previous block of
+//  their size class in the first payload word and their own header address in the last one.
+//  Allocated blocks keep the [size, 42] header, so freeMem(), tbrk() and thalt() work unchanged.
+
+// Set when a free block ends at the given word, so its footer can be trusted
+uint8_t segFreeEnd[(UINT16_MAX + 1) / 8];
+
+static inline void segMarkEnd(uint32_t addr, bool isFree) {
+    if (isFree) segFreeEnd[addr >> 3] |= (uint8_t)(1 << (addr & 7));
+    else segFreeEnd[addr >> 3] &= (uint8_t)~(1 << (addr & 7));
+}
+
+static inline bool segIsEnd(uint32_t addr) {
+    return (segFreeEnd[addr >> 3] >> (addr & 7)) & 1;
+}
+
+// Return the size class of a block with the given payload size
+static inline uint16_t segClass(uint16_t size) {
+    return 31 - __builtin_clz(size);
+}
+
+// Push a free block onto the list of its size class
+void segInsert(uint16_t header) {
+    uint16_t size = mem[header];
+    uint16_t c = segClass(size);
+    uint16_t head = mem[SEG_HEADS + c];
+
+    mem[header + 1] = head; // Next free block of the same class
+    mem[header + 2] = 0;    // Previous free block of the same class
+    mem[header + size + 1] = header; // Footer
+    if (head != 0) mem[head + 2] = header;
+
+    mem[SEG_HEADS + c] = header;
+    mem[SEG_NONEMPTY] |= (uint16_t)(1 << c);
+    segMarkEnd(header + size + 1, true);
+}
+
+// Unlink a free block from the list of its size class
+void segRemove(uint16_t header) {
+    uint16_t size = mem[header];
+    uint16_t c = segClass(size);
+    uint16_t next = mem[header + 1];
+    uint16_t prev = mem[header + 2];
+
+    if (prev != 0) mem[prev + 1] = next;
+    else mem[SEG_HEADS + c] = next;
+    if (next != 0) mem[next + 2] = prev;
+
+    if (mem[SEG_HEADS + c] == 0) mem[SEG_NONEMPTY] &= (uint16_t)~(1 << c);
+    segMarkEnd(header + size + 1, false);
+}
+
+// Return a free block back to its size class, merging it with free physical neighbours
+void segRelease(uint16_t header) {
+    uint16_t size = mem[header];
+    uint32_t next = (uint32_t)header + size + 2;
+
+    // The next neighbour always starts right after this block and is free unless it carries the magic
+    if (next < UINT16_MAX && mem[next + 1] != 42 && segIsEnd(next + mem[next] + 1)) {
+        segRemove(next);
+        size += mem[next] + 2;
+    }
+
+    // The previous neighbour is only reachable through its footer, which exists only while it is free
+    if (header > OS_MEM_SIZE && segIsEnd(header - 1)) {
+        uint16_t prev = mem[header - 1];
+        segRemove(prev);
+        size += mem[prev] + 2;
+        header = prev;
+    }
+
+    mem[header] = size;
+    segInsert(header);
+}
+
+// Reset the size classes so the only free block is the one of the given size at the start of the region
+void segReset(uint16_t size) {
+    memset(segFreeEnd, 0, sizeof(segFreeEnd));
+    for (int c = 0; c < SEG_CLASSES; c++) mem[SEG_HEADS + c] = 0;
+    mem[SEG_NONEMPTY] = 0;
+    mem[OS_MEM_SIZE] = size;
+    segInsert(OS_MEM_SIZE);
+}
+
+// Reset the size classes so the whole region above the OS is a single free block
+void segInit() {
+    segReset(0xEFFE);
+}
+
+// Allocate from the size classes, returns 0 when no block is large enough
+uint16_t segAlloc(uint16_t size) {
+    if (size < SEG_MIN_FREE) size = SEG_MIN_FREE; // So the block can go back on a list later
+    uint16_t c = segClass(size);
+    uint16_t header = 0;
+
+    // Any block of a larger class fits, so only this class may need a walk
+    uint16_t larger = mem[SEG_NONEMPTY] & (uint16_t)~((2u << c) - 1);
+    if (larger != 0) {
+        header = mem[SEG_HEADS + __builtin_ctz(larger)];
+    }
+    else {
+        for (uint16_t h = mem[SEG_HEADS + c]; h != 0; h = mem[h + 1]) {
+            PROF(prof.allocWalk++);
+            if (mem[h] >= size) {
+                header = h;
+                break;
+            }
+        }
+    }
+    if (header == 0) {
+        return 0;
+    }
+
+    segRemove(header);
+    uint16_t freeSize = mem[header];
+
+    // Carve from the tail and keep the rest free if it can hold a free block
+    if (freeSize >= size + 2 + SEG_MIN_FREE) {
+        uint16_t newHeader = header + freeSize - size;
+        mem[header] = freeSize - size - 2;
+        segInsert(header);
+        header = newHeader;
+    }
+    else {
+        size = freeSize; // Hand out the whole block rather than leave an unusable sliver
+    }
+
+    setHeader(header, size, 42);
+    return header + 2;
+}
+
+// Resize an allocated block in place, growing into the free block right after it
+bool segResize(uint16_t header, uint16_t newSize, uint16_t pid) {
+    uint16_t size = mem[header];
+
+    if (newSize > size) {
+        uint16_t need = newSize - size;
+        uint32_t next = (uint32_t)header + size + 2;
+
+        if (next >= UINT16_MAX || mem[next + 1] == 42) {
+            printf("Cannot allocate more space for the heap of pid %d since we bumped into an allocated region.\n", pid);
+            return false;
+        }
+        uint16_t nextSize = mem[next];
+        if (nextSize + 2 < need) {
+            printf("Cannot allocate more space for the heap of pid %d since total free space size here is not enough.\n", pid);
+            return false;
+        }
+
+        segRemove(next);
+        if (nextSize + 2 - need >= 2 + SEG_MIN_FREE) {
+            uint16_t rest = header + 2 + newSize;
+            mem[rest] = nextSize - need;
+            segInsert(rest);
+            mem[header] = newSize;
+        }
+        else {
+            mem[header] = size + nextSize + 2; // Absorb the whole neighbour
+        }
+    }
+    else if (size - newSize >= 2 + SEG_MIN_FREE) {
+        // Split the tail off and release it like any other block
+        uint16_t tail = header + 2 + newSize;
+        mem[tail] = size - newSize - 2;
+        mem[header] = newSize;
+        segRelease(tail);
+    }
+
+    return true;
+}
+
 // Return the address of the process control block (PCB) for the process with the provided pid
 uint16_t computePcbAddress(uint16_t pid) {
-    return 12 + pid * PCB_SIZE; // Calculate the PCB address based on the process ID and PCB size
+    return PCB_BASE + pid * PCB_SIZE; // Calculate the PCB address based on the process ID and PCB size
+}
+
+// Take a pid off the free-PID list, or the next never-used one. Returns 0xFFFF when none is left.
+uint16_t allocPid() {
+    uint16_t pid = mem[PID_FREE];
+    if (pid != 0xFFFF) {
+        mem[PID_FREE] = mem[RQ_NEXT + pid];
+        return pid;
+    }
+
+    pid = mem[Proc_Count];
+    if (pid >= MAX_PROC_COUNT) {
+        return 0xFFFF; // Every PCB belongs to a live process
+    }
+    mem[Proc_Count]++; // Increment the process count
+    return pid;
+}
+
+// Put the pid of a halted process, already off the run queue, on the free-PID list
+void freePid(uint16_t pid) {
+    mem[RQ_NEXT + pid] = mem[PID_FREE];
+    mem[PID_FREE] = pid;
 }
 
 // Save the current process's registers to its PCB
 void saveProcessState() {
-    uint16_t pid = mem[Cur_Proc_ID]; // Get the current process ID
+    uint16_t pid = curProc; // Get the current process ID
     uint16_t pcbAddress = computePcbAddress(pid); // Calculate the PCB address
-    simulateDelay(10)
 
     // Save the registers to the PCB
     mem[pcbAddress + PC_PCB] = reg[RPC];
@@ -247,23 +1365,118 @@ void saveProcessState() {
     mem[pcbAddress + BDC_PCB] = reg[RBDC];
     mem[pcbAddress + BSH_PCB] = reg[RBSH];
     mem[pcbAddress + BDH_PCB] = reg[RBDH];
+
+    // A preempted process can stop anywhere and may resume on another CPU, so its general purpose registers must survive too
+    if (mlfqQuantum != 0 || vmCpus > 1) {
+        memcpy(procRegs[pid], reg, RPC * sizeof(uint16_t));
+        procRegs[pid][RPC] = reg[RCND];
+    }
 }
 
-// Find and return the process ID of the next runnable process
-uint16_t findNextRunnableProcess() {
-    uint16_t pid = mem[Cur_Proc_ID]; // Get the current process ID
-    uint16_t nextProcID = (pid + 1) % mem[Proc_Count]; // Calculate the next process ID by making sure to loop back
+// Append a process to the tail of the run queue of its level
+void rqInsert(uint16_t pid) {
+    uint16_t headAddr = RQ_HEAD + mem[RQ_LEVEL + pid];
+    uint16_t head = mem[headAddr];
+
+    if (head == 0xFFFF) {
+        // Only process in the queue, it links to itself
+        mem[RQ_NEXT + pid] = pid;
+        mem[RQ_PREV + pid] = pid;
+        mem[headAddr] = pid;
+        return;
+    }
+
+    uint16_t tail = mem[RQ_PREV + head];
+    mem[RQ_NEXT + pid] = head;
+    mem[RQ_PREV + pid] = tail;
+    mem[RQ_NEXT + tail] = pid;
+    mem[RQ_PREV + head] = pid;
+}
+
+// Unlink a process from the run queue of its level
+void rqRemove(uint16_t pid) {
+    uint16_t headAddr = RQ_HEAD + mem[RQ_LEVEL + pid];
+    uint16_t next = mem[RQ_NEXT + pid];
+    uint16_t prev = mem[RQ_PREV + pid];
+
+    if (next == pid) {
+        mem[headAddr] = 0xFFFF; // The queue is now empty
+        return;
+    }
+
+    mem[RQ_NEXT + prev] = next;
+    mem[RQ_PREV + next] = prev;
+    if (mem[headAddr] == pid) {
+        mem[headAddr] = next;
+    }
+}
+
+// Move a process to another MLFQ level
+void rqSetLevel(uint16_t pid, uint16_t level) {
+    rqRemove(pid);
+    mem[RQ_LEVEL + pid] = level;
+    rqInsert(pid);
+}
+
+// Pick the process to run after pid: round robin inside the highest non-empty level.
+// When pid is leaving, it is never picked and its level may turn out to be empty.
+uint16_t rqPick(uint16_t pid, bool leaving) {
+    uint16_t level = mem[RQ_LEVEL + pid];
+    uint16_t next = mem[RQ_NEXT + pid];
+
+    for (uint16_t l = 0; l < mlfqLevels; l++) {
+        if (mem[RQ_HEAD + l] == 0xFFFF) {
+            continue;
+        }
+        if (l == level) {
+            if (next != pid) return next;
+            if (!leaving) return pid;
+            continue; // pid was alone in its level
+        }
+        return mem[RQ_HEAD + l];
+    }
+
+    return pid; // Nothing else is runnable
+}
 
-    // Iterate through the PCBs to find the next runnable process
-    while (mem[12 + nextProcID * PCB_SIZE] == 0xFFFF) {
-        nextProcID = (nextProcID + 1) % mem[Proc_Count];
-        if (nextProcID == mem[Cur_Proc_ID]) {
-            // No other runnable process, continue with the current process    
-            break;
+// Return the first process of the highest non-empty level, 0xFFFF if every level is empty.
+// The process is unlinked when take is set.
+uint16_t rqTake(bool take) {
+    for (uint16_t l = 0; l < mlfqLevels; l++) {
+        uint16_t pid = mem[RQ_HEAD + l];
+        if (pid != 0xFFFF) {
+            if (take) rqRemove(pid);
+            return pid;
         }
     }
+    return 0xFFFF;
+}
+
+#ifdef VM_SMP
+// Wait with the OS lock held until a process is ready, returns 0xFFFF once every process has halted
+uint16_t smpWaitForWork() {
+    uint16_t pid;
+    while ((pid = rqTake(true)) == 0xFFFF && mem[LIVE_COUNT] != 0) {
+        pthread_cond_wait(&osReady, &osMutex);
+    }
+    return pid;
+}
+#endif
 
-    return nextProcID; // Return the next runnable process ID
+// Find and return the process ID of the next runnable process
+uint16_t findNextRunnableProcess() {
+#ifdef VM_SMP
+    // With several CPUs the running processes are off the run queue, so any queued one is ready.
+    // Keep the current one unless the best ready process has at least its priority.
+    if (vmCpus > 1) {
+        uint16_t next = rqTake(false);
+        if (next == 0xFFFF || mem[RQ_LEVEL + next] > mem[RQ_LEVEL + curProc]) return curProc;
+        return next;
+    }
+#endif
+    // The run queue only holds live processes, so no PCB has to be scanned.
+    // It is the current process itself when nothing else is runnable.
+    return rqPick(curProc, false);
 }
 
 // Check if an address is valid within a segment, and if so, set the base and bound values for the segment
@@ -273,7 +1486,9 @@ bool isAddrValid(uint16_t addr, uint16_t *base, uint16_t *bound) {
 
     // Check if the segment is valid (code or heap segment)
     if ((segment & 0xC) == 0x0 && (segment != 0x3)) {
+        outFlush(); // Fault messages must come after the guest's earlier output
         printf("Segmentation Fault.\n");
+        PROF(prof.faults++);
         return false;
     }
 
@@ -287,84 +1502,791 @@ bool isAddrValid(uint16_t addr, uint16_t *base, uint16_t *bound) {
         *bound = reg[RBDH];
     } 
     else {
+        PROF(prof.faults++);
         return false;
     }
 
     // Perform bound check to ensure the offset is within the segment's bound
     if (offset > *bound) {
+        outFlush(); // Fault messages must come after the guest's earlier output
         if (segment == 0x4) {
             printf("Segmentation Fault Inside Heap Segment.\n");
         } else if (segment == 0x3) {
             printf("Segmentation Fault Inside Code Segment.\n");
         }
+        PROF(prof.faults++);
         return false;
     }
 
     return true;
 }
 
-// Initialize the operating system's memory management structures
-void initOS() {
-    mem[Cur_Proc_ID] = 0xFFFF; // Set the current process ID to an invalid value
-    mem[Proc_Count] = 0; // Initialize the process count to zero
-    mem[OS_MEM_SIZE] = 0xEFFE; // Set the size of the operating system's memory region
+// Segment TLB: one entry per segment (first 4 bits of an address) of the running process
+typedef struct {
+    uint16_t *host; // Host pointer to the first word of the segment
+    uint16_t size;  // Number of valid offsets, 0 for segments that always fault
+} stlb_entry;
+
+VM_LOCAL stlb_entry stlb[16];
+VM_LOCAL stlb_entry stlbw[16]; // Same for writes, without the code segment while it is shared
+
+// Page TLB: direct-mapped on the page number, so code pages 0x30-0x3F and heap pages 0x40-0x4F never collide
+#define PTLB_SIZE 32
+typedef struct {
+    uint16_t *host; // Host pointer to the first word of the frame
+    uint16_t tag;   // Page number + 1, 0 for an empty entry
+    uint16_t size;  // Number of offsets inside the segment bound
+} ptlb_entry;
+
+VM_LOCAL ptlb_entry ptlb[PTLB_SIZE];
+
+// Put every frame above the OS region on the free list
+void pageInit() {
+    mem[PF_FREE] = 0;
+    for (uint16_t f = UINT16_MAX >> PAGE_SHIFT; f >= (OS_MEM_SIZE >> PAGE_SHIFT); f--) {
+        mem[f << PAGE_SHIFT] = mem[PF_FREE]; // Free frames link through their first word
+        mem[PF_FREE] = f;
+    }
 }
 
-// Create a new process
-int createProc(char *fname, char* hname) {
+// Take a zeroed frame off the free list, 0 when none is left
+uint16_t pageAlloc() {
+    uint16_t f = mem[PF_FREE];
+    if (f == 0) {
+        return 0;
+    }
+    mem[PF_FREE] = mem[f << PAGE_SHIFT];
+    memset(mem + (f << PAGE_SHIFT), 0, PAGE_WORDS * sizeof(uint16_t));
+    if (++framesUsed > framesPeak) framesPeak = framesUsed;
+    return f;
+}
 
-    // Check if the process count has reached the maximum allowed processes
-    if (mem[Proc_Count] == 340) {
-        mem[OS_STATUS] = 0xF000; // Set the OS status to indicate that memory is full
+// Put a frame back on the free list
+void pageFree(uint16_t f) {
+    mem[f << PAGE_SHIFT] = mem[PF_FREE]; // Free frames link through their first word
+    mem[PF_FREE] = f;
+    framesUsed--;
+}
+
+// Free the mapped pages of entries first to last of a page table
+void pageUnmap(uint16_t table, uint16_t first, uint16_t last) {
+    for (uint16_t p = first; p <= last; p++) {
+        if (mem[table + p] & PTE_PRESENT) {
+            pageFree(mem[table + p] & 0xFF);
+            mem[table + p] = 0;
+        }
     }
+}
 
-    // Check if the OS status indicates that memory is full
-    if ((mem[OS_STATUS] & 0xF000) == 0xF000) {
-        printf("The OS memory region is full. Cannot create a new PCB.\n");
-        return 1; 
+// Map entries from first on to fresh frames holding the given words. Returns false when frames run out.
+bool pageLoad(uint16_t table, uint16_t first, uint16_t *words, size_t n) {
+    for (size_t done = 0; done < n; done += PAGE_WORDS, first++) {
+        uint16_t f = pageAlloc();
+        if (f == 0) {
+            return false;
+        }
+        size_t len = n - done < PAGE_WORDS ? n - done : PAGE_WORDS;
+        memcpy(mem + (f << PAGE_SHIFT), words + done, len * sizeof(uint16_t));
+        mem[table + first] = PTE_PRESENT | f;
     }
+    return true;
+}
 
-    uint16_t pid = mem[Proc_Count]; // Get the new process ID
-    mem[Proc_Count]++; // Increment the process count
-    uint16_t pcbAddress = computePcbAddress(pid); // Calculate the PCB address
+// Host address of a guest address of the running process under paging, or NULL after reporting a fault.
+// Heap pages that were never touched are mapped to a zeroed frame here.
+uint16_t *pageTranslate(uint16_t addr) {
+    uint16_t vpn = addr >> PAGE_SHIFT;
+    uint16_t offset = addr & (PAGE_WORDS - 1);
+    ptlb_entry *e = &ptlb[vpn & (PTLB_SIZE - 1)];
+
+    if (e->tag == vpn + 1 && offset < e->size) {
+        return e->host + offset;
+    }
+
+    // Segment and bound are checked as with segmentation; both base registers hold the page table
+    uint16_t table, bound;
+    if (!isAddrValid(addr, &table, &bound)) {
+        return NULL;
+    }
+
+    uint16_t *pte = &mem[table + vpn - (0x3000 >> PAGE_SHIFT)];
+    if (!(*pte & PTE_PRESENT)) {
+        osLock();
+        uint16_t f = pageAlloc();
+        osUnlock();
+        if (f == 0) {
+            outFlush(); // Fault messages must come after the guest's earlier output
+            printf("Out of page frames.\n");
+            return NULL;
+        }
+        *pte = PTE_PRESENT | f;
+    }
+
+    uint16_t first = (addr & 0x0FFF) & ~(PAGE_WORDS - 1); // Segment offset of the page's first word
+    e->host = mem + ((*pte & 0xFF) << PAGE_SHIFT);
+    e->tag = vpn + 1;
+    e->size = bound - first >= PAGE_WORDS - 1 ? PAGE_WORDS : bound - first + 1;
+    return e->host + offset;
+}
+
+// Refill the segment TLB from the base and bound registers of the running process
+void stlbFill() {
+    memset(stlb, 0, sizeof(stlb)); // Every segment goes through isAddrValid() by default
+    if (pagingMode) {
+        memset(stlbw, 0, sizeof(stlbw)); // Paged segments are not contiguous, so every access uses the page TLB
+        memset(ptlb, 0, sizeof(ptlb));
+        return;
+    }
+
+    // Offsets are 12 bits wide, so a bound of 4096 or more covers the whole segment
+    stlb[0x3].host = mem + reg[RBSC];
+    stlb[0x3].size = reg[RBDC] >= 0x0FFF ? 0x1000 : reg[RBDC] + 1;
+    stlb[0x4].host = mem + reg[RBSH];
+    stlb[0x4].size = reg[RBDH] >= 0x0FFF ? 0x1000 : reg[RBDH] + 1;
+
+    // With a lazy heap, words that were never touched take the slow path to be zeroed
+    if (lazyHeap && stlb[0x4].size > mem[HEAP_TOUCHED + curProc]) {
+        stlb[0x4].size = mem[HEAP_TOUCHED + curProc];
+    }
+
+    memcpy(stlbw, stlb, sizeof(stlb));
+    if (mem[CODE_IMG + curProc] != 0) {
+        stlbw[0x3].size = 0; // Writes to a shared code segment must fault and copy
+    }
+}
+
+// Free memory statistics
+
+// Add one free block of the given size to the statistics
+static inline void freeStatsAdd(vm_freestats *s, uint16_t size) {
+    if (size == 0) return; // First fit leaves empty headers behind until they coalesce
+    s->total += size;
+    s->blocks++;
+    if (size > s->largest) s->largest = size;
+    s->hist[31 - __builtin_clz(size)]++;
+}
+
+// Walk the free list of the current allocator once and summarise it
+void freeStats(vm_freestats *s) {
+    memset(s, 0, sizeof(*s));
+    if (pagingMode) {
+        for (uint16_t f = mem[PF_FREE]; f != 0; f = mem[f << PAGE_SHIFT]) freeStatsAdd(s, PAGE_WORDS);
+    }
+    else if (allocPolicy == ALLOC_SEGFIT) {
+        for (int c = 0; c < SEG_CLASSES; c++) {
+            for (uint16_t h = mem[SEG_HEADS + c]; h != 0; h = mem[h + 1]) freeStatsAdd(s, mem[h]);
+        }
+    }
+    else {
+        for (uint16_t h = OS_MEM_SIZE; h != 0; h = mem[h + 1]) freeStatsAdd(s, mem[h]);
+    }
+}
+
+// Percentage of the free words that lie outside the largest free block
+double freeFragPct(const vm_freestats *s) {
+    if (pagingMode) return 0.0; // Any free frame can back any page
+    return s->total ? 100.0 * (s->total - s->largest) / s->total : 0.0;
+}
+
+void freeReport(const char *when, const vm_freestats *s) {
+    fprintf(stderr, "Free memory %s: %u words in %u blocks, largest %u (%.1f%% fragmented); blocks by size:",
+            when, s->total, s->blocks, s->largest, freeFragPct(s));
+    for (int b = 0; b < FREE_HIST_BUCKETS; b++) {
+        if (s->hist[b] != 0) fprintf(stderr, " %u+:%u", 1u << b, s->hist[b]);
+    }
+    fputc('\n', stderr);
+}
+
+// Called with the OS lock held on every context switch when VM_FREE_REPORT is set
+void freeSample() {
+    vm_freestats s;
+    uint16_t need = pagingMode ? PAGE_WORDS : lazyHeap ? IMG_GRANULE + 2 : HEAP_INIT_SIZE + 2; // a new heap, or one more frame
+
+    freeStats(&s);
+    freeSamples++;
+    if (s.largest < freeLowest) freeLowest = s.largest;
+    if (s.largest < need && !freeAlerted) {
+        fprintf(stderr, "Warning: the largest free block has %u words, a new process needs %u.\n", s.largest, need);
+    }
+    freeAlerted = s.largest < need;
+    if (freeSamples % freeReportEvery == 0) {
+        char when[48];
+        snprintf(when, sizeof(when), "after %llu switches", (unsigned long long)freeSamples);
+        freeReport(when, &s);
+    }
+}
+
+// Heap relocation and compaction
+
+// Check whether the heap of the running process can grow to newSize words without moving.
+// tbrkLocked() grows exactly when this holds, so tbrk() relocates the heap only when growing would fail.
+bool heapGrowsInPlace(uint16_t newSize) {
+    uint16_t header = reg[RBSH] - 2;
+    uint16_t size = mem[header];
+    uint32_t next = (uint32_t)header + size + 2;
+
+    if (newSize <= size) return true;
+    return next < UINT16_MAX && mem[next + 1] != 42 && mem[next] + 2 >= newSize - size;
+}
+
+// Resize the heap block of the running process to newSize words in place, leaving the bound alone.
+// Growing takes words from the free block after the heap, so callers check heapGrowsInPlace() first.
+// Shrinking frees the tail.
+void heapResizeBlock(uint16_t newSize) {
+    uint16_t heapHeader = reg[RBSH] - 2;
+    uint16_t blockSize = getFreeSize(heapHeader); // Words in the heap block, at least the old bound unless the heap is lazy
+    uint32_t nextHeader = (uint32_t)heapHeader + blockSize + 2; // Block right after the heap
+
+    // The segregated-fit allocator resizes in place without walking the free list
+    if (allocPolicy == ALLOC_SEGFIT) {
+        segResize(heapHeader, newSize, curProc);
+        return;
+    }
+
+    if (newSize > blockSize) {
+        // Take the growth from the front of the free block after the heap
+        uint16_t prevHeader = getFreePrevHeader(heapHeader); // The free block before it in the list
+        uint16_t nextFree = getFreeNext(nextHeader);
+        uint16_t growth = newSize - blockSize;
+        uint16_t left = getFreeSize(nextHeader) + 2 - growth; // Words of the free block not taken
+
+        if (left >= 2) {
+            // The rest stays a free block, possibly an empty one
+            uint16_t restHeader = nextHeader + growth;
+            setHeader(restHeader, left - 2, nextFree);
+            mem[prevHeader + 1] = restHeader;
+            if (mem[ALLOC_ROVER] == nextHeader) mem[ALLOC_ROVER] = restHeader; // Keep the next-fit rover on the list
+            blockSize = newSize;
+        }
+        else {
+            // A single word would be left, too little for a header, so the heap takes it as well
+            mem[prevHeader + 1] = nextFree;
+            if (mem[ALLOC_ROVER] == nextHeader) mem[ALLOC_ROVER] = prevHeader; // Keep the next-fit rover on the list
+            blockSize += getFreeSize(nextHeader) + 2;
+        }
+        setHeader(heapHeader, blockSize, 42); // Update the heap header with the new size
+    }
+    else if (blockSize - newSize >= 2) {
+        // The tail becomes a block of its own and is freed
+        uint16_t tailHeader = heapHeader + newSize + 2;
+        setHeader(tailHeader, blockSize - newSize - 2, 42);
+        setHeader(heapHeader, newSize, 42);
+        freeMem(tailHeader + 2);
+    }
+}
+
+// Point every reference to the block at oldBase to newBase
+void rebaseBlock(uint16_t oldBase, uint16_t newBase) {
+    for (uint16_t pid = 0; pid < mem[Proc_Count]; pid++) {
+        uint16_t pcbAddress = computePcbAddress(pid);
+        if (mem[pcbAddress + PID_PCB] == 0xFFFF) continue;
+        if (mem[pcbAddress + BSH_PCB] == oldBase) mem[pcbAddress + BSH_PCB] = newBase;
+        if (mem[pcbAddress + BSC_PCB] == oldBase) mem[pcbAddress + BSC_PCB] = newBase;
+    }
+    for (int e = 0; e < IMG_MAX; e++) {
+        uint16_t entry = IMG_TABLE + e * IMG_SIZE;
+        if (mem[entry + REFS_IMG] != 0 && mem[entry + BASE_IMG] == oldBase) mem[entry + BASE_IMG] = newBase;
+    }
+    if (reg[RBSH] == oldBase) reg[RBSH] = newBase;
+    if (reg[RBSC] == oldBase) reg[RBSC] = newBase;
+}
+
+// Slide every allocated block to the top of memory so all free space becomes one block at OS_MEM_SIZE.
+// Only other CPUs' registers could still point at the old places, so this is limited to one CPU.
+bool compactMemory() {
+    static uint16_t blocks[(UINT16_MAX + 1 - OS_MEM_SIZE) / 4];
+    int count = 0;
+
+    if (vmCpus > 1) return false;
+
+    for (uint32_t h = OS_MEM_SIZE; h < UINT16_MAX; h += mem[h] + 2) {
+        if (mem[h + 1] == 42) blocks[count++] = h;
+    }
 
-    // Allocate memory for the code segment
-    uint16_t codeAddress = allocMem(4096); // Allocate 4KB for code
+    // Move from the highest block down so no block overwrites one that has not moved yet
+    uint32_t end = UINT16_MAX + 1;
+    for (int k = count - 1; k >= 0; k--) {
+        uint16_t header = blocks[k];
+        uint16_t words = mem[header] + 2;
+        uint16_t newHeader = end - words;
+        if (newHeader != header) {
+            memmove(mem + newHeader, mem + header, words * sizeof(uint16_t));
+            rebaseBlock(header + 2, newHeader + 2);
+        }
+        end = newHeader;
+    }
+
+    if (end - OS_MEM_SIZE < 2 + SEG_MIN_FREE) {
+        return false; // Not even room for a free block header
+    }
+    if (allocPolicy == ALLOC_SEGFIT) {
+        segReset(end - OS_MEM_SIZE - 2);
+    }
+    else {
+        setHeader(OS_MEM_SIZE, end - OS_MEM_SIZE - 2, 0);
+        mem[ALLOC_ROVER] = OS_MEM_SIZE;
+    }
+
+#ifdef VM_DECODE_CACHE
+    dcacheInvalidate(OS_MEM_SIZE, UINT16_MAX + 1 - OS_MEM_SIZE); // Code moved
+#endif
+    stlbFill();
+    return true;
+}
+
+// Compact memory when most of the free space is in blocks smaller than the largest one
+void compactIfFragmented() {
+    vm_freestats s;
+
+    freeStats(&s);
+    if (compactFrag > 0 && freeFragPct(&s) > compactFrag) {
+        compactMemory();
+    }
+}
+
+// Move the heap of the running process to a block of newSize words, compacting memory under VM_COMPACT if no
+// block is large enough. The bound is left to the caller. Returns false when the heap could not move.
+bool relocateHeap(uint16_t newSize) {
+    uint16_t pcbAddress = computePcbAddress(curProc);
+
+    uint16_t newBase = allocMem(newSize);
+    if (newBase == 0 && compactOnTbrk && compactMemory()) {
+        newBase = allocMem(newSize);
+    }
+    if (newBase == 0) {
+        return false;
+    }
+
+    // Compaction may have moved the old heap, so read its base only now
+    uint16_t oldBase = reg[RBSH];
+    uint16_t oldSize = mem[oldBase - 2];
+    memcpy(mem + newBase, mem + oldBase, (oldSize < newSize ? oldSize : newSize) * sizeof(uint16_t));
+    freeMem(oldBase);
+
+    mem[pcbAddress + BSH_PCB] = newBase;
+    reg[RBSH] = newBase;
+    stlbFill();
+    return true;
+}
+
+// Shared code images
+
+// FNV-1a hash of a code image
+uint32_t hashImage(uint16_t *words, uint16_t size) {
+    uint32_t h = 2166136261u;
+    for (uint16_t k = 0; k < size; k++) {
+        h = (h ^ words[k]) * 16777619u;
+    }
+    return h;
+}
+
+// Return the base of a code segment holding the given image, sharing an existing one when the content matches.
+// The segment is sized to the image, rounded up to IMG_GRANULE words, and its length is stored in *len.
+uint16_t mapCodeImage(uint16_t pid, char *fname, uint16_t *len) {
+    static uint16_t img[CODE_SIZE];
+    size_t n = readImage(fname, img, CODE_SIZE);
+
+    uint16_t size = (n + IMG_GRANULE - 1) / IMG_GRANULE * IMG_GRANULE;
+    if (size == 0) size = IMG_GRANULE;
+    *len = size;
+
+    uint32_t h = hashImage(img, size);
+    int freeEntry = -1;
+
+    for (int e = 0; e < IMG_MAX; e++) {
+        uint16_t entry = IMG_TABLE + e * IMG_SIZE;
+        if (mem[entry + REFS_IMG] == 0) {
+            if (freeEntry < 0) freeEntry = e;
+            continue;
+        }
+        // A hash match is confirmed word by word before sharing
+        if (mem[entry + LEN_IMG] == size && mem[entry + HLO_IMG] == (h & 0xFFFF) && mem[entry + HHI_IMG] == (h >> 16) &&
+            memcmp(mem + mem[entry + BASE_IMG], img, size * sizeof(uint16_t)) == 0) {
+            mem[entry + REFS_IMG]++;
+            mem[CODE_IMG + pid] = e + 1;
+            return mem[entry + BASE_IMG];
+        }
+    }
+
+    uint16_t codeAddress = allocMem(size);
     if (codeAddress == 0) {
+        return 0;
+    }
+    memcpy(mem + codeAddress, img, size * sizeof(uint16_t));
+#ifdef VM_DECODE_CACHE
+    dcacheInvalidate(codeAddress, size); // Stale decodes of whatever was loaded here before
+#endif
+
+    // Register the image so later processes can share it, or keep it private when the table is full
+    mem[CODE_IMG + pid] = 0;
+    if (freeEntry >= 0) {
+        uint16_t entry = IMG_TABLE + freeEntry * IMG_SIZE;
+        mem[entry + BASE_IMG] = codeAddress;
+        mem[entry + REFS_IMG] = 1;
+        mem[entry + HLO_IMG] = h & 0xFFFF;
+        mem[entry + HHI_IMG] = h >> 16;
+        mem[entry + LEN_IMG] = size;
+        mem[CODE_IMG + pid] = freeEntry + 1;
+    }
+    return codeAddress;
+}
+
+// Drop a process's reference to its code segment, freeing it with the last reference
+void unmapCodeImage(uint16_t pid, uint16_t codeBase) {
+    uint16_t e = mem[CODE_IMG + pid];
+    mem[CODE_IMG + pid] = 0;
+
+    if (e != 0) {
+        uint16_t entry = IMG_TABLE + (e - 1) * IMG_SIZE;
+        if (--mem[entry + REFS_IMG] != 0) {
+            return; // Still used by other processes
+        }
+    }
+    freeMem(codeBase);
+}
+
+// Give the running process a private copy of its shared code segment before it writes to it.
+// Returns false when there is no memory for the copy.
+bool copyCodeOnWrite() {
+    osLock();
+    uint16_t pid = curProc;
+    uint16_t entry = IMG_TABLE + (mem[CODE_IMG + pid] - 1) * IMG_SIZE;
+
+    if (mem[entry + REFS_IMG] == 1) {
+        // Last user: the segment simply stops being shared
+        mem[entry + REFS_IMG] = 0;
+    }
+    else {
+        uint16_t size = reg[RBDC] + 1;
+        uint16_t copy = allocMem(size);
+        if (copy == 0 && compactOnTbrk && compactMemory()) {
+            copy = allocMem(size); // Compaction moves the shared segment too, reg[RBSC] follows it
+        }
+        if (copy == 0) {
+            printf("Cannot copy the code segment of pid %d.\n", pid);
+            osUnlock();
+            return false;
+        }
+        memcpy(mem + copy, mem + reg[RBSC], size * sizeof(uint16_t));
+#ifdef VM_DECODE_CACHE
+        dcacheInvalidate(copy, size);
+#endif
+        mem[entry + REFS_IMG]--;
+        reg[RBSC] = copy;
+        mem[computePcbAddress(pid) + BSC_PCB] = copy;
+    }
+
+    mem[CODE_IMG + pid] = 0;
+    stlbFill();
+    osUnlock();
+    return true;
+}
+
+// Snapshot files: a header, then mem[] at SNAP_MEM_OFFSET, then the host-side state the OS region depends on
+#define SNAP_MAGIC "LC3SNAP"
+#define SNAP_VERSION 3
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t memWords;      // words of mem[] in the file
+    uint32_t maxProc;       // MAX_PROC_COUNT, which fixes the OS region layout
+    uint16_t reg[RCNT];     // registers of the loaded process
+    uint16_t curProc;
+    uint16_t framesUsed, framesPeak;
+    uint8_t running;
+    uint8_t allocPolicy, pagingMode, lazyHeap; // options that change what mem[] means
+    uint8_t mlfqLevels;     // run queues in use, a process on any other level would never run
+} vm_snapshot;
+
+_Static_assert(sizeof(vm_snapshot) <= SNAP_MEM_OFFSET, "snapshot header overlaps mem");
+
+// Write the whole VM state to a snapshot file. Call it between instructions, with a process loaded.
+bool vmCheckpoint(const char *path) {
+    outFlush();
+    vm_snapshot h = { SNAP_MAGIC, SNAP_VERSION, UINT16_MAX + 1, MAX_PROC_COUNT };
+    memcpy(h.reg, reg, sizeof(reg));
+    h.curProc = curProc;
+    h.framesUsed = framesUsed;
+    h.framesPeak = framesPeak;
+    h.running = running;
+    h.allocPolicy = allocPolicy;
+    h.pagingMode = pagingMode;
+    h.lazyHeap = lazyHeap;
+    h.mlfqLevels = mlfqLevels;
+
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open file %s.\n", path);
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, out) == 1 && fseek(out, SNAP_MEM_OFFSET, SEEK_SET) == 0 &&
+              fwrite(mem, sizeof(mem), 1, out) == 1 && fwrite(procRegs, sizeof(procRegs), 1, out) == 1 &&
+              fwrite(segFreeEnd, sizeof(segFreeEnd), 1, out) == 1;
+    ok = fclose(out) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Cannot write snapshot %s.\n", path);
+    }
+    return ok;
+}
+
+// Replace the VM state with a snapshot. mem[] is mapped copy-on-write from the file, so pages the guest
+// never touches are never read, and one snapshot can seed any number of runs.
+bool vmRestore(const char *path) {
+    vm_snapshot h;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open file %s.\n", path);
+        return false;
+    }
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, SNAP_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != SNAP_VERSION || h.memWords != UINT16_MAX + 1 || h.maxProc != MAX_PROC_COUNT) {
+        fprintf(stderr, "%s is not a snapshot of this VM version.\n", path);
+        close(fd);
+        return false;
+    }
+    if (h.mlfqLevels != mlfqLevels) {
+        fprintf(stderr, "%s was taken with %u scheduling levels, not %u.\n", path, h.mlfqLevels, mlfqLevels);
+        close(fd);
+        return false;
+    }
+
+    off_t tail = SNAP_MEM_OFFSET + sizeof(mem);
+    bool ok = pread(fd, procRegs, sizeof(procRegs), tail) == sizeof(procRegs) &&
+              pread(fd, segFreeEnd, sizeof(segFreeEnd), tail + sizeof(procRegs)) == sizeof(segFreeEnd);
+    if (ok && (SNAP_MEM_OFFSET % sysconf(_SC_PAGESIZE) != 0 ||
+               mmap(mem, sizeof(mem), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, SNAP_MEM_OFFSET) == MAP_FAILED)) {
+        ok = pread(fd, mem, sizeof(mem), SNAP_MEM_OFFSET) == sizeof(mem); // Host pages too large to map in place
+    }
+    close(fd); // The mapping stays valid
+    if (!ok) {
+        fprintf(stderr, "Cannot read snapshot %s.\n", path);
+        return false;
+    }
+
+    memcpy(reg, h.reg, sizeof(reg));
+    curProc = h.curProc;
+    framesUsed = h.framesUsed;
+    framesPeak = h.framesPeak;
+    running = h.running;
+    allocPolicy = h.allocPolicy;
+    pagingMode = h.pagingMode;
+    lazyHeap = h.lazyHeap;
+
+    if (curProc != 0xFFFF) {
+        mlfqSliceLeft = mlfqQuantum << mem[RQ_LEVEL + curProc]; // Scheduling options come from this run
+    }
+    stlbFill();
+#ifdef VM_DECODE_CACHE
+    dcacheInvalidate(0, UINT16_MAX + 1);
+#endif
+    return true;
+}
+
+// Initialize the operating system's memory management structures
+void initOS() {
+    mem[Cur_Proc_ID] = 0xFFFF; // Set the current process ID to an invalid value
+    curProc = 0xFFFF;
+    mem[LIVE_COUNT] = 0;
+    mem[Proc_Count] = 0; // Initialize the process count to zero
+    mem[PID_FREE] = 0xFFFF; // No pid to recycle yet
+    for (int l = 0; l < MLFQ_MAX_LEVELS; l++) {
+        mem[RQ_HEAD + l] = 0xFFFF; // No runnable process yet
+    }
+    mem[OS_MEM_SIZE] = 0xEFFE; // Set the size of the operating system's memory region
+    mem[ALLOC_ROVER] = OS_MEM_SIZE;
+
+    // Pick the allocator
+    char *alloc = getenv("VM_ALLOC");
+    for (int p = 0; alloc != NULL && p < (int)(sizeof(allocPolicyNames) / sizeof(allocPolicyNames[0])); p++) {
+        if (strcmp(alloc, allocPolicyNames[p]) == 0) allocPolicy = p;
+    }
+    if (allocPolicy == ALLOC_SEGFIT) {
+        segInit();
+    }
+
+    // Pick the scheduling policy
+    char *opt;
+    if ((opt = getenv("VM_QUANTUM")) != NULL) {
+        mlfqQuantum = strtoul(opt, NULL, 10);
+    }
+    if (mlfqQuantum != 0) {
+        mlfqLevels = 3;
+        mlfqBoost = 100 * (uint64_t)mlfqQuantum;
+    }
+    if ((opt = getenv("VM_LEVELS")) != NULL) {
+        mlfqLevels = atoi(opt);
+        if (mlfqLevels < 1) mlfqLevels = 1;
+        if (mlfqLevels > MLFQ_MAX_LEVELS) mlfqLevels = MLFQ_MAX_LEVELS;
+    }
+    if ((opt = getenv("VM_COMPACT")) != NULL) {
+        compactOnTbrk = atoi(opt) != 0;
+    }
+    if ((opt = getenv("VM_COMPACT_FRAG")) != NULL) {
+        compactFrag = atoi(opt);
+    }
+    if ((opt = getenv("VM_STRICT_IO")) != NULL) {
+        strictIO = atoi(opt) != 0;
+    }
+    if ((opt = getenv("VM_LAZY_HEAP")) != NULL) {
+        lazyHeap = atoi(opt) != 0;
+    }
+    if ((opt = getenv("VM_BOOST")) != NULL) {
+        mlfqBoost = strtoull(opt, NULL, 10);
+    }
+    if ((opt = getenv("VM_FREE_REPORT")) != NULL) {
+        freeReportEvery = strtoull(opt, NULL, 10);
+    }
+    if ((opt = getenv("VM_PAGING")) != NULL && atoi(opt) != 0) {
+        pagingMode = true;
+        pageInit(); // Frames replace the free list of the allocators
+    }
+
+#ifdef VM_SMP
+    if ((opt = getenv("VM_CPUS")) != NULL && atoi(opt) > 1) {
+        vmCpus = atoi(opt);
+    }
+#endif
+#ifdef VM_TRACE
+    traceOpen();
+    if (traceFile != NULL) vmCpus = 1; // Interleavings between CPUs are not recorded
+#endif
+
+    // The processes come from a snapshot, so the driver's calls to set them up are skipped
+    restorePath = getenv("VM_RESTORE");
+}
+
+// Give a new process a page table, with its code image and heap file loaded into frames.
+// Heap pages past the file are mapped on first touch. Returns false when frames run out.
+bool createPagedProc(uint16_t pid, char *fname, char *hname) {
+    static uint16_t img[CODE_SIZE];
+    uint16_t pcbAddress = computePcbAddress(pid);
+
+    uint16_t table = pageAlloc();
+    size_t n = readImage(fname, img, CODE_SIZE);
+    uint16_t codeSize = (n + IMG_GRANULE - 1) / IMG_GRANULE * IMG_GRANULE;
+    if (codeSize == 0) codeSize = IMG_GRANULE;
+    if (table == 0) {
+        printf("Cannot create code segment.\n");
+        return false;
+    }
+    if (!pageLoad(table << PAGE_SHIFT, 0, img, codeSize)) {
         printf("Cannot create code segment.\n");
-        return 0; // Return failure
+        pageUnmap(table << PAGE_SHIFT, 0, SEG_PAGES - 1);
+        pageFree(table);
+        return false;
     }
-    ld_img((char *)fname, codeAddress, 4096); // Load code from file
-    mem[pcbAddress + BSC_PCB] = codeAddress; // Set the base address of the code segment
-    mem[pcbAddress + BDC_PCB] = CODE_SIZE; // Set the bound (size) of the code segment
+    mem[CODE_IMG + pid] = 0; // Paged code is always private
+    mem[pcbAddress + BSC_PCB] = table << PAGE_SHIFT; // Both base fields hold the page table
+    mem[pcbAddress + BDC_PCB] = codeSize - 1;
 
-    // Allocate memory for the heap segment
-    uint16_t heap_address = allocMem(4096); // Allocate 4KB for heap
-    if (heap_address == 0) {
+    n = readImage(hname, img, HEAP_INIT_SIZE);
+    if (!pageLoad(table << PAGE_SHIFT, SEG_PAGES, img, n)) {
         printf("Cannot create heap segment.\n");
-        return 0; // Return failure
+        pageUnmap(table << PAGE_SHIFT, 0, 2 * SEG_PAGES - 1);
+        pageFree(table);
+        return false;
     }
-    ld_img((char *)hname, heap_address, 4096); // Load heap from file
-    mem[pcbAddress + BSH_PCB] = heap_address; // Set the base address of the heap segment
-    mem[pcbAddress + BDH_PCB] = HEAP_INIT_SIZE; // Set the bound (size) of the heap segment
+    mem[pcbAddress + BSH_PCB] = table << PAGE_SHIFT;
+    mem[pcbAddress + BDH_PCB] = HEAP_INIT_SIZE;
+    return true;
+}
+
+// Create a new process
+int createProc(char *fname, char* hname) {
+    if (restorePath != NULL) {
+        return 0; // run() restores every process from the snapshot
+    }
+
+    // Recycle the pid of a halted process, or take a new one
+    uint16_t pid = allocPid(); // Get the new process ID
+    if (pid == 0xFFFF) {
+        mem[OS_STATUS] = 0xF000; // Set the OS status to indicate that memory is full
+        printf("The OS memory region is full. Cannot create a new PCB.\n");
+        return 1; 
+    }
+    mem[OS_STATUS] = 0;
+    uint16_t pcbAddress = computePcbAddress(pid); // Calculate the PCB address
+    memset(mem + pcbAddress, 0, PCB_SIZE * sizeof(uint16_t)); // A recycled PCB starts out like a fresh one
+    memset(procRegs[pid], 0, (RPC + 1) * sizeof(uint16_t));
+
+    if (pagingMode) {
+        if (!createPagedProc(pid, fname, hname)) {
+            freePid(pid);
+            return 0; // Return failure
+        }
+    }
+    else {
+        // Map the code segment, shared with every process running the same image
+        uint16_t codeSize;
+        uint16_t codeAddress = mapCodeImage(pid, fname, &codeSize);
+        if (codeAddress == 0) {
+            printf("Cannot create code segment.\n");
+            freePid(pid);
+            return 0; // Return failure
+        }
+        mem[pcbAddress + BSC_PCB] = codeAddress; // Set the base address of the code segment
+        mem[pcbAddress + BDC_PCB] = codeSize - 1; // Set the bound (last valid offset) of the code segment
+
+        // Allocate memory for the heap segment, a lazy heap starts with just its image and grows on first touch
+        static uint16_t img[HEAP_INIT_SIZE];
+        size_t n = lazyHeap ? readImage(hname, img, HEAP_INIT_SIZE) : HEAP_INIT_SIZE;
+        uint16_t heapSize = (n + IMG_GRANULE - 1) / IMG_GRANULE * IMG_GRANULE;
+        if (heapSize == 0) heapSize = IMG_GRANULE;
+        uint16_t heap_address = allocMem(heapSize);
+        if (heap_address == 0) {
+            printf("Cannot create heap segment.\n");
+            unmapCodeImage(pid, codeAddress);
+            freePid(pid);
+            return 0; // Return failure
+        }
+        if (lazyHeap) {
+            memcpy(mem + heap_address, img, n * sizeof(uint16_t));
+            mem[HEAP_TOUCHED + pid] = n;
+        }
+        else {
+            mem[HEAP_TOUCHED + pid] = ld_img((char *)hname, heap_address, HEAP_INIT_SIZE); // Load heap from file
+        }
+        mem[pcbAddress + BSH_PCB] = heap_address; // Set the base address of the heap segment
+        mem[pcbAddress + BDH_PCB] = HEAP_INIT_SIZE; // Set the bound (size) of the heap segment
+    }
+
+    mem[pcbAddress + PID_PCB] = pid; // Mark the PCB as live
+    mem[RQ_LEVEL + pid] = 0; // New processes start at the highest priority
+    rqInsert(pid); // Make the process runnable
+    mem[LIVE_COUNT]++;
 
     return 0; 
 }
 
 // Load process into CPU registers
 void loadProc(uint16_t pid) {
+    if (restorePath != NULL) {
+        return; // run() restores the loaded process from the snapshot
+    }
     uint16_t pcbAddress = computePcbAddress(pid); // Calculate the PCB address
     mem[Cur_Proc_ID] = pid; // Set the current process ID
+    curProc = pid;
+    TRACE(traceEvent(EV_SWITCH, pid, 0));
+    if (freeReportEvery != 0) freeSample();
     // Load the registers from the PCB
     reg[RPC] = mem[pcbAddress + PC_PCB];
     reg[RBSC] = mem[pcbAddress + BSC_PCB];
     reg[RBDC] = mem[pcbAddress + BDC_PCB];
     reg[RBSH] = mem[pcbAddress + BSH_PCB];
     reg[RBDH] = mem[pcbAddress + BDH_PCB];
+    stlbFill(); // Translations of the previous process are no longer valid
+    mlfqSliceLeft = mlfqQuantum << mem[RQ_LEVEL + pid]; // Fresh time slice for the level
+    if (mlfqQuantum != 0 || vmCpus > 1) {
+        memcpy(reg, procRegs[pid], RPC * sizeof(uint16_t));
+        reg[RCND] = procRegs[pid][RPC];
+    }
 }
 
 // Free allocated memory block
 int freeMem(uint16_t ptr) {
+    PROF(prof.freeCalls++);
+    TRACE(traceEvent(EV_FREE, ptr, 0));
     // Check if the address is within valid range
     if (ptr < OS_MEM_SIZE || ptr > 65535) {
         return 1; // 
@@ -372,7 +2294,6 @@ int freeMem(uint16_t ptr) {
     
     uint16_t addrHeader = ptr - 2; // Calculate the header address of the given address
 
-    uint16_t chunkSize = mem[addrHeader]; // Get the size of the chunk
     uint16_t magicNumber = mem[addrHeader + 1]; // Get the magic number
 
     // Check if the magic number is valid
@@ -380,6 +2301,11 @@ int freeMem(uint16_t ptr) {
         return 1;
     }
 
+    if (allocPolicy == ALLOC_SEGFIT) {
+        segRelease(addrHeader);
+        return 0;
+    }
+
     uint16_t prevHeader = getFreePrevHeader(addrHeader); // Get the previous free block's header
     uint16_t nextHeader = getFreeNextHeader(addrHeader); // Get the next free block's header
 
@@ -392,132 +2318,271 @@ int freeMem(uint16_t ptr) {
     return 0; // Return success
 }
 
-// Allocate memory block
+// Allocate memory block, returning 0 when no free block is large enough
 uint16_t allocMem(uint16_t size) {
-    uint16_t header = 4096; // Start from the beginning of the free list
+    PROF(prof.allocCalls++);
+    if (allocPolicy == ALLOC_SEGFIT) {
+        uint16_t block = segAlloc(size);
+        TRACE(traceEvent(EV_ALLOC, size, block));
+        return block;
+    }
+
+    uint16_t start = allocPolicy == ALLOC_NEXT_FIT ? mem[ALLOC_ROVER] : OS_MEM_SIZE; // Next fit resumes at the rover
+    uint16_t header = start;
+    uint16_t best = 0;
     uint16_t freeSize;
 
-    // Iterate through the free list to find a suitable free block
-    while (header != 65535) {
+    // Iterate through the free list to find a suitable free block, up to the 0 that ends it
+    do {
         freeSize = getFreeSize(header);
         // Check if the current free block is large enough
         if (freeSize >= size + 2) {
-            uint16_t newHeader = header + freeSize - size; // Calculate the new header address
-            
-            setHeader(newHeader, size, 42); // Set the new header with size and magic number
-
-            // If there is remaining space, update the original free block's header
-            if (remainingSpace > 0) {
-                setHeader(header, remainingSpace, getFreeNext(header));
+            if (allocPolicy != ALLOC_BEST_FIT) {
+                best = header;
+                break;
+            }
+            if (best == 0 || freeSize < getFreeSize(best)) {
+                best = header; // Smallest block that fits so far
+                if (freeSize == size + 2) break; // Nothing fits better than an exact fit
             }
-            return newHeader + 2; // Return the address of the allocated memory block
         }
         header = getFreeNext(header); // Move to the next free block
+        if (header == 0 && allocPolicy == ALLOC_NEXT_FIT) header = OS_MEM_SIZE; // Wrap around to the start
+        PROF(prof.allocWalk++);
+    } while (header != 0 && header != start);
+
+    if (best == 0) {
+        TRACE(traceEvent(EV_ALLOC, size, 0));
+        return 0; // Every policy returns 0 when nothing fits, no block can start inside the OS region
     }
-    return 1; 
+
+    freeSize = getFreeSize(best);
+    uint16_t newHeader = best + freeSize - size; // Calculate the new header address
+    setHeader(newHeader, size, 42); // Set the new header with size and magic number
+
+    // Shrink the original free block's header, down to an empty block when nothing is left
+    uint16_t remainingSpace = freeSize - size - 2;
+    setHeader(best, remainingSpace, getFreeNext(best));
+    mem[ALLOC_ROVER] = best; // The next next-fit search resumes here
+    TRACE(traceEvent(EV_ALLOC, size, newHeader + 2));
+    return newHeader + 2; // Return the address of the allocated memory block
 }
 
 // Implement tbrk system call
 static inline void tbrk() {
-    uint16_t pid = mem[Cur_Proc_ID]; // Get the current process ID
+    osLock();
+    if (compactOnTbrk && !pagingMode && !lazyHeap && reg[R0] > reg[RBDH] && !heapGrowsInPlace(reg[R0])) {
+        // Growing in place would fail, move the heap instead and then only the bound changes
+        if (relocateHeap(reg[R0])) {
+            tbrkLocked();
+        }
+        else {
+            outFlush(); // Keep guest output ahead of the tbrk message
+            printf("Cannot allocate more space for the heap of pid %d since total free space size here is not enough.\n", curProc);
+        }
+    }
+    else {
+        tbrkLocked();
+    }
+    if (reg[RBDH] != reg[R0]) tbrkFailures++;
+    osUnlock();
+}
+
+// Body of tbrk, called with the OS lock held
+void tbrkLocked() {
+    outFlush(); // Keep guest output ahead of any tbrk message
+    uint16_t pid = curProc; // Get the current process ID
     uint16_t pcbAddress = computePcbAddress(pid); // Calculate the PCB address
 
     uint16_t oldSize = reg[RBDH]; // Get the old size of the heap
     uint16_t newSize = reg[R0]; // Get the new size of the heap from register R0
-    int sizeDiff = newSize - oldSize; // Calculate the size difference
 
     uint16_t heapBase = reg[RBSH]; // Get the base address of the heap
     uint16_t heapHeader = heapBase - 2; // Calculate the header address of the heap
 
-    uint16_t prevHeader = getFreePrevHeader(heapHeader); // Get the previous free block's header
-    uint16_t nextHeader = getFreeNextHeader(heapHeader); // Get the next free block's header
+    // Paged heaps only move their bound: growth is mapped on first touch and shrinking frees whole pages
+    if (pagingMode) {
+        if (newSize < 0x0FFF) {
+            pageUnmap(heapBase, SEG_PAGES + (newSize >> PAGE_SHIFT) + 1, 2 * SEG_PAGES - 1);
+        }
+        mem[pcbAddress + BDH_PCB] = newSize; // Update the PCB with the new heap size
+        reg[RBDH] = newSize; // Update the live bound register as well
+        memset(ptlb, 0, sizeof(ptlb)); // Cached page sizes follow the old bound
+        return;
+    }
 
     if (newSize == oldSize) {
         return; // If the new size is equal to old size, return without doing anything
     }
 
-    // Check if we need to allocate more space and there is no next free block
-    if (nextHeader == 0 && sizeDiff > 0) {
-        printf("Cannot allocate more space for the heap of pid %d since we bumped into an allocated region.\n", pid);
-        return;
-    }
-    
-    uint16_t nextNextFree;
-
-    // Clear the next free block if it exists
-    if (nextHeader != 0) {
-        nextNextFree = getFreeNext(nextHeader);
-        setHeader(nextHeader, 0, 0);
-        convertToUpper('s');
-    }
-
-    uint16_t newNextHeader;
-
-    // If we need to expand the heap
-    if (newSize < oldSize) {
-        // Check if we can expand into the next free block
-        if (isContiguous(heapHeader, nextHeader) && (getFreeSize(nextHeader) + 2 >= sizeDiff)) {
-            // If the next free block is too large, create a new header for the remaining space
-            if (getFreeSize(nextHeader) - sizeDiff > 2) {
-                newNextHeader = nextHeader + sizeDiff;
-                setHeader(prevHeader, getFreeSize(prevHeader), newNextHeader);
-                setHeader(newNextHeader, getFreeSize(nextHeader) - sizeDiff, nextNextFree);
-            }
-            setHeader(heapHeader, newSize, 42); // Update the heap header with the new size
-            mem[pcbAddress + BDH_PCB] = newSize; // Update the PCB with the new heap size
-        } 
-        else {
+    // If we need to expand the heap. A lazy heap only moves its bound, its block grows on first touch.
+    if (newSize > oldSize && !lazyHeap) {
+        if (!heapGrowsInPlace(newSize)) {
             // If we cannot expand the heap, print an error message
-            if (getFreeSize(prevHeader) < sizeDiff) {
-                printf("Cannot allocate more space for the heap of pid %d since total free space size here is not enough.\n", pid);
+            uint32_t nextHeader = (uint32_t)heapHeader + getFreeSize(heapHeader) + 2; // Block right after the heap
+            if (nextHeader >= UINT16_MAX || mem[nextHeader + 1] == 42) {
+                printf("Cannot allocate more space for the heap of pid %d since we bumped into an allocated region.\n", pid);
             }
             else {
-                printf("Cannot allocate more space for the heap of pid %d since we bumped into an allocated region.\n", pid);
+                printf("Cannot allocate more space for the heap of pid %d since total free space size here is not enough.\n", pid);
             }
             return;
         }
-    } else {
-        // If we need to shrink the heap
-        if ((-sizeDiff) >= 2) {
-            newNextHeader = heapHeader + oldSize + 2 + sizeDiff;
-            setHeader(newNextHeader, -sizeDiff - 2, 42);
-            setHeader(heapHeader, newSize, 42);
-            freeMem(newNextHeader + 2);
-            prevHeader = getFreePrevHeader(newNextHeader);
+        heapResizeBlock(newSize);
+    }
+    else if (newSize < getFreeSize(heapHeader)) {
+        heapResizeBlock(newSize); // If we need to shrink the heap, the tail of the block is freed
+    }
+
+    mem[pcbAddress + BDH_PCB] = newSize; // Update the PCB with the new heap size
+    reg[RBDH] = newSize; // Update the live bound register as well
+    if (mem[HEAP_TOUCHED + pid] > newSize) mem[HEAP_TOUCHED + pid] = newSize; // Regrown words get zeroed again
+    stlbFill(); // Heap translation now covers the new bound
+}
+
+// Preemptive scheduling
+
+// Save the running process and load another one, timing the switch
+void switchProc(uint16_t nextProcID) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    outFlush(); // The buffer only ever holds the output of the running process
+    saveProcessState(); // Save the current process state
+    PROF(prof.pidSwitches[curProc]++);
+#ifdef VM_SMP
+    if (vmCpus > 1) {
+        // The next process leaves the run queue and this one goes back to it for other CPUs
+        rqRemove(nextProcID);
+        rqInsert(curProc);
+        pthread_cond_signal(&osReady);
+    }
+#endif
+    loadProc(nextProcID); // Load the next process
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    switchCount++;
+    switchNanos += (t1.tv_sec - t0.tv_sec) * 1000000000ull + (t1.tv_nsec - t0.tv_nsec);
+}
+
+// Move every live process back to the highest priority level
+void mlfqBoostAll() {
+    for (uint16_t l = 1; l < mlfqLevels; l++) {
+        while (mem[RQ_HEAD + l] != 0xFFFF) {
+            rqSetLevel(mem[RQ_HEAD + l], 0);
         }
-        mem[pcbAddress + BDH_PCB] = newSize; // Update the PCB with the new heap size
     }
+    // With several CPUs the running processes are not queued, so they only get their level reset
+    for (uint16_t pid = 0; vmCpus > 1 && pid < mem[Proc_Count]; pid++) {
+        if (mem[computePcbAddress(pid) + PID_PCB] != 0xFFFF) mem[RQ_LEVEL + pid] = 0;
+    }
+}
+
+// Called by run() when the running process used up its time slice
+void mlfqPreempt() {
+    osLock();
+    uint16_t pid = curProc;
+    uint16_t level = mem[RQ_LEVEL + pid];
+
+    // A process that uses its whole slice is CPU-bound, so it loses priority
+    if (level + 1 < mlfqLevels) {
+        if (vmCpus > 1) mem[RQ_LEVEL + pid] = level + 1; // Running processes are not queued
+        else rqSetLevel(pid, level + 1);
+    }
+
+    uint16_t nextProcID = findNextRunnableProcess();
+    if (nextProcID != pid) {
+        switchProc(nextProcID);
+    }
+    else {
+        mlfqSliceLeft = mlfqQuantum << mem[RQ_LEVEL + pid];
+    }
+    osUnlock();
+}
+
+// Charge one instruction to the running process, returns true if another process was loaded
+static inline bool mlfqTick() {
+    if (mlfqBoost != 0 && ++mlfqBoostPending >= (vmCpus > 1 ? MLFQ_BOOST_BATCH : 1)) {
+        osLock();
+        mlfqSinceBoost += mlfqBoostPending; // One count for all CPUs, so a boost fires once per mlfqBoost instructions
+        mlfqBoostPending = 0;
+        if (mlfqSinceBoost >= mlfqBoost) {
+            mlfqSinceBoost = 0;
+            mlfqBoostAll();
+        }
+        osUnlock();
+    }
+    if (--mlfqSliceLeft == 0) {
+        mlfqPreempt();
+        return true;
+    }
+    return false;
 }
 
 // System call implementations
 
 // Implement tyld system call to yield the processor
 static inline void tyld() {
+    osLock();
     uint16_t nextProcID = findNextRunnableProcess(); // Find the next runnable process
-    uint16_t pid = mem[Cur_Proc_ID]; // Get the current process ID
+    uint16_t pid = curProc; // Get the current process ID
 
     // If the current process is not the same as the next process
     if (pid != nextProcID) {
-        saveProcessState(); // Save the current process state
+        outFlush();
         printf("We are switching from process %d to %d.\n", pid, nextProcID);
-        loadProc(nextProcID); // Load the next process
+        switchProc(nextProcID);
     }
+    osUnlock();
 }
 
 // Implement thalt system call to halt the process
 static inline void thalt() {
-    uint16_t pid = mem[Cur_Proc_ID]; // Get the current process ID
+    osLock();
+    outFlush(); // The process leaves the CPU
+    uint16_t pid = curProc; // Get the current process ID
     uint16_t pcbAddress = computePcbAddress(pid); // Calculate the PCB address    
 
     // Free the code and heap segments of the terminating process
     uint16_t heapBase = mem[pcbAddress + BSH_PCB]; // Get the base address of the heap
     uint16_t codeBase = mem[pcbAddress + BSC_PCB]; // Get the base address of the code
 
-    freeMem(heapBase); // Free the heap memory
-    freeMem(codeBase); // Free the code memory
+    if (pagingMode) {
+        pageUnmap(codeBase, 0, 2 * SEG_PAGES - 1); // Free every mapped page
+        pageFree(codeBase >> PAGE_SHIFT); // Then the page table itself
+    }
+    else {
+        freeMem(heapBase); // Free the heap memory
+        unmapCodeImage(pid, codeBase); // Free the code memory unless other processes share it
+    }
 
-    uint16_t nextProcID = findNextRunnableProcess(); // Find the next runnable process
+    mem[pcbAddress + PID_PCB] = 0xFFFF; // Tombstone the PCB
+    mem[LIVE_COUNT]--;
+#ifdef VM_SMP
+    if (vmCpus > 1) freePid(pid); // Running processes are not on the run queue
+#endif
+    if (compactFrag > 0 && !pagingMode) compactIfFragmented();
+
+#ifdef VM_SMP
+    if (vmCpus > 1) {
+        // This CPU takes the next ready process, or waits for one while others are still running
+        uint16_t nextProcID = smpWaitForWork();
+        if (nextProcID == 0xFFFF) {
+            pthread_cond_broadcast(&osReady); // Let idle CPUs see that everything has halted
+            running = false;
+        }
+        else {
+            loadProc(nextProcID);
+        }
+        osUnlock();
+        return;
+    }
+#endif
+
+    uint16_t nextProcID = rqPick(pid, true); // Find the next runnable process other than this one
 
+    rqRemove(pid); // The process is no longer runnable
+    freePid(pid); // Its pid can be given to the next new process
 
     // If the current process is the same as the next process
     if (pid == nextProcID) {
@@ -528,26 +2593,106 @@ static inline void thalt() {
         // Load the next process
         loadProc(nextProcID);
     }
+    osUnlock();
 } 
 
+// Grow the block of a lazy heap to size words, moving the heap when the next block is in the way
+bool heapGrowBlock(uint16_t size) {
+    osLock();
+    bool grown = heapGrowsInPlace(size);
+    if (grown) {
+        heapResizeBlock(size);
+    }
+    else {
+        grown = relocateHeap(size);
+    }
+    osUnlock();
+
+    if (!grown) {
+        outFlush(); // Fault messages must come after the guest's earlier output
+        printf("Cannot allocate more space for the heap of pid %d since total free space size here is not enough.\n", curProc);
+        PROF(prof.faults++);
+    }
+    return grown;
+}
+
+// Zero the heap of the running process up to and including the given offset on its first touch, growing
+// the heap block first when the offset lies past it. Returns false when the block cannot grow.
+bool heapTouch(uint16_t offset) {
+    uint16_t touched = mem[HEAP_TOUCHED + curProc];
+
+    if (offset >= touched) {
+        // Zero a whole granule at a time so the next accesses stay on the fast path
+        uint32_t end = (offset / IMG_GRANULE + 1) * IMG_GRANULE;
+        if (end > (uint32_t)reg[RBDH] + 1) end = (uint32_t)reg[RBDH] + 1;
+        if (end > mem[reg[RBSH] - 2] && !heapGrowBlock(end)) {
+            return false;
+        }
+        memset(mem + reg[RBSH] + touched, 0, (end - touched) * sizeof(uint16_t));
+        mem[HEAP_TOUCHED + curProc] = end;
+        stlbFill();
+    }
+    return true;
+}
+
 // Memory read method
 uint16_t mr(uint16_t addr) {
     uint16_t base, bound;
     uint16_t offset = addr & 0x0FFF;
+    stlb_entry *e = &stlb[addr >> 12];
 
-    if (isAddrValid(addr, &base, &bound))
-        return mem[base + offset];
+    // Common case: the offset is inside a segment cached by the TLB
+    if (offset < e->size)
+        return e->host[offset];
 
+    if (pagingMode) {
+        uint16_t *p = pageTranslate(addr);
+        return p != NULL ? *p : 0;
+    }
+
+    // Slow path reports the fault
+    if (isAddrValid(addr, &base, &bound)) {
+        if (lazyHeap && (addr >> 12) == 0x4) {
+            if (!heapTouch(offset)) return 0;
+            base = reg[RBSH]; // Growing the block may have moved the heap
+        }
+        return mem[base + offset];
+    }
+    return 0; // The fault has been reported, the access reads as 0 like an unmapped page
 }
 
 // Memory write method
 void mw(uint16_t addr, uint16_t value) {
     uint16_t base, bound;
     uint16_t offset = addr & 0x0FFF;
+    stlb_entry *e = &stlbw[addr >> 12];
 
-    if (isAddrValid(addr, &base, &bound))
+    if (offset < e->size) {
+        e->host[offset] = value;
+    }
+    else if (pagingMode) {
+        uint16_t *p = pageTranslate(addr);
+        if (p != NULL) *p = value;
+        return; // Paged code is never in the decode cache
+    }
+    else if (isAddrValid(addr, &base, &bound)) {
+        if (lazyHeap && (addr >> 12) == 0x4) {
+            if (!heapTouch(offset)) return;
+            base = reg[RBSH]; // Growing the block may have moved the heap
+        }
+        // A shared code segment is copied on the first write
+        if ((addr >> 12) == 0x3 && mem[CODE_IMG + curProc] != 0) {
+            if (!copyCodeOnWrite()) return;
+            base = reg[RBSC];
+        }
         mem[base + offset] = value;
-
+    }
+    else {
+        return;
+    }
+#ifdef VM_DECODE_CACHE
+    if ((addr >> 12) == 0x3) dcacheInvalidateWord(offset); // Self-modifying code
+#endif
 }
 
 
@@ -0,0 +1,383 @@
+// Benchmark harness for vm.c
+//  Generates synthetic LC-3 images, runs each workload in a forked copy of a fresh VM and reports
+//  guest MIPS, context switch latency, allocMem()/freeMem() latency and fragmentation.
+//
+//  usage: vmbench [baselines [--update]]
+//  With a baseline file, every metric listed there is compared against it and the run fails when one
+//  is worse by more than BENCH_TOLERANCE percent (default 30). --update rewrites the file instead.
+//  VM options (VM_ALLOC, VM_QUANTUM, VM_PAGING, ...) are read from the environment as usual, except that
+//  the allocator churn runs once under every VM_ALLOC policy.
+#ifndef VM_REPORT_IPS
+#define VM_REPORT_IPS // Guest instruction counts
+#endif
+#include "vm.c"
+
+#include <sys/wait.h>
+
+#define BENCH_REPEAT 3      // runs per workload, the best one is kept
+#define BENCH_MAX_METRICS 32
+
+typedef struct {
+    char name[32];
+    double value;
+    bool higherIsBetter;
+} bench_metric;
+
+bench_metric metrics[BENCH_MAX_METRICS];
+int metricCount = 0;
+
+// Guest code generation
+//  Images are assembled into a word buffer with one helper per instruction form.
+typedef struct {
+    uint16_t w[CODE_SIZE];
+    int n;
+} bench_img;
+
+static void emit(bench_img *img, uint16_t word) { img->w[img->n++] = word; }
+static void asmAdd(bench_img *img, int dr, int sr, int imm) { emit(img, 0x1000 | dr << 9 | sr << 6 | 0x20 | (imm & 0x1F)); }
+static void asmAddReg(bench_img *img, int dr, int sr1, int sr2) { emit(img, 0x1000 | dr << 9 | sr1 << 6 | sr2); }
+static void asmAnd(bench_img *img, int dr, int sr, int imm) { emit(img, 0x5000 | dr << 9 | sr << 6 | 0x20 | (imm & 0x1F)); }
+static void asmLdr(bench_img *img, int dr, int base, int off) { emit(img, 0x6000 | dr << 9 | base << 6 | (off & 0x3F)); }
+static void asmStr(bench_img *img, int sr, int base, int off) { emit(img, 0x7000 | sr << 9 | base << 6 | (off & 0x3F)); }
+static void asmTrap(bench_img *img, int vector) { emit(img, 0xF000 | vector); }
+
+// Branch with condition bits nzp back to the instruction at index target
+static void asmBr(bench_img *img, int nzp, int target) { emit(img, nzp << 9 | ((target - img->n - 1) & 0x1FF)); }
+
+// Load a constant into dr: LD from a data word placed right after the load, skipped by a branch
+static void asmConst(bench_img *img, int dr, uint16_t value) {
+    emit(img, 0x2000 | dr << 9 | 1);    // LD dr, next word + 1
+    emit(img, 0x0E01);                  // BRnzp over the data word
+    emit(img, value);
+}
+
+char imageNames[8][64];
+int imageCount = 0;
+
+// Write an image to a temporary file and return its name
+static char *writeImage(bench_img *img, const char *tag) {
+    char *name = imageNames[imageCount++];
+    snprintf(name, sizeof(imageNames[0]), "/tmp/vmbench_%s_%d.obj", tag, (int)getpid());
+    FILE *out = fopen(name, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open file %s.\n", name);
+        exit(1);
+    }
+    fwrite(img->w, sizeof(uint16_t), img->n, out);
+    fclose(out);
+    return name;
+}
+
+// Images are only read by createProc(), so they can go once every process exists
+static void removeImages() {
+    while (imageCount > 0) unlink(imageNames[--imageCount]);
+}
+
+// Workloads
+//  Each one builds its images, creates its processes and returns the number of processes created.
+//  Loops run outer x inner times with R1 and R2 as counters.
+#define R_OUTER 5
+#define R_INNER 6
+
+static void loopStart(bench_img *img, uint16_t outer, uint16_t inner, int *outerTop, int *innerTop) {
+    asmConst(img, R_OUTER, outer);
+    *outerTop = img->n;
+    asmConst(img, R_INNER, inner);
+    *innerTop = img->n;
+}
+
+static void loopEnd(bench_img *img, int outerTop, int innerTop) {
+    asmAdd(img, R_INNER, R_INNER, -1);
+    asmBr(img, 1, innerTop);             // BRp inner
+    asmAdd(img, R_OUTER, R_OUTER, -1);
+    asmBr(img, 1, outerTop);             // BRp outer
+    asmTrap(img, 0x25);                   // HALT
+}
+
+// Tight register arithmetic
+static int wlArith(char *heap) {
+    bench_img img = {0};
+    int outerTop, innerTop;
+    loopStart(&img, 400, 20000, &outerTop, &innerTop);
+    asmAdd(&img, 0, 0, 1);
+    asmAddReg(&img, 2, 2, 0);
+    asmAnd(&img, 3, 2, 7);
+    loopEnd(&img, outerTop, innerTop);
+    createProc(writeImage(&img, "arith"), heap);
+    return 1;
+}
+
+// Read-modify-write over the whole heap segment
+static int wlStream(char *heap) {
+    bench_img img = {0};
+    asmConst(&img, R_OUTER, 600);
+    int outerTop = img.n;
+    asmConst(&img, R_INNER, 4000);
+    asmConst(&img, 1, 0x4000);           // R1 walks the heap from its first word
+    int innerTop = img.n;
+    asmLdr(&img, 0, 1, 0);
+    asmAdd(&img, 0, 0, 1);
+    asmStr(&img, 0, 1, 0);
+    asmAdd(&img, 1, 1, 1);
+    loopEnd(&img, outerTop, innerTop);
+    createProc(writeImage(&img, "stream"), heap);
+    return 1;
+}
+
+// Console output through OUT and the decimal printing trap
+static int wlTrapIO(char *heap) {
+    bench_img img = {0};
+    int outerTop, innerTop;
+    loopStart(&img, 200, 1000, &outerTop, &innerTop);
+    asmConst(&img, 0, 'x');
+    asmTrap(&img, 0x21);                  // OUT
+    asmAddReg(&img, 0, R_INNER, R_INNER);
+    asmTrap(&img, 0x27);                  // decimal output
+    loopEnd(&img, outerTop, innerTop);
+    createProc(writeImage(&img, "io"), heap);
+    return 1;
+}
+
+// Many processes that yield after every few instructions
+static int wlYield(char *heap) {
+    bench_img img = {0};
+    int outerTop, innerTop;
+    loopStart(&img, 50, 100, &outerTop, &innerTop);
+    asmAdd(&img, 0, 0, 1);
+    asmTrap(&img, 0x28);                  // YIELD
+    loopEnd(&img, outerTop, innerTop);
+    char *code = writeImage(&img, "yield");
+    int n;
+    for (n = 0; n < 12; n++) {
+        createProc(code, heap);
+    }
+    return n;
+}
+
+// Heap shrinking and regrowth through tbrk, every call must move the bound or the workload fails
+static int wlTbrk(char *heap) {
+    bench_img img = {0};
+    int outerTop, innerTop;
+    loopStart(&img, 100, 500, &outerTop, &innerTop);
+    asmConst(&img, 0, 1024);
+    asmTrap(&img, 0x29);                  // TBRK down
+    asmConst(&img, 0, HEAP_INIT_SIZE);
+    asmTrap(&img, 0x29);                  // TBRK back up
+    loopEnd(&img, outerTop, innerTop);
+    char *code = writeImage(&img, "tbrk");
+    createProc(code, heap);
+    createProc(code, heap);
+    return 2;
+}
+
+typedef struct {
+    const char *name;
+    int (*create)(char *heap);
+} bench_workload;
+
+bench_workload workloads[] = {
+    { "arith", wlArith },
+    { "stream", wlStream },
+    { "trap_io", wlTrapIO },
+    { "yield", wlYield },
+    { "tbrk", wlTbrk },
+};
+
+// Run one workload on this VM and send its metrics to fd as "name value" lines, returning false if a tbrk failed
+static bool runWorkload(bench_workload *wl, int fd) {
+    bench_img heapImg = { .n = 1 };
+    char *heap = writeImage(&heapImg, "heap");
+
+    initOS();
+    int n = wl->create(heap);
+    removeImages();
+    for (int pid = 0; pid < n; pid++) {
+        mem[computePcbAddress(pid) + PC_PCB] = PC_START;
+    }
+    loadProc(0);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    run(NULL, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    dprintf(fd, "%s_mips %f\n", wl->name, secs > 0 ? executedTotal / secs / 1e6 : 0.0);
+    if (switchCount != 0) {
+        dprintf(fd, "%s_switch_ns %f\n", wl->name, (double)switchNanos / switchCount);
+    }
+    return tbrkFailures == 0; // A heap that did not resize would time the error path instead
+}
+
+// Allocator churn: a fixed trace of allocations and frees over CHURN_SLOTS slots, mixing 4096-word
+// segments with small blocks. Every policy replays the same random draws; a failed allocation only
+// leaves its slot empty, so the next draw for that slot allocates again instead of freeing.
+#define CHURN_SLOTS 48
+#define CHURN_OPS 60000
+#define CHURN_SAMPLE 64     // ops between fragmentation samples
+
+static void runAllocator(const char *policy, int fd) {
+    setenv("VM_ALLOC", policy, 1);
+    initOS();
+    uint16_t live[CHURN_SLOTS] = {0};
+    uint32_t seed = 12345;
+    uint64_t allocs = 0, frees = 0, fails = 0, samples = 0;
+    double allocSecs = 0, freeSecs = 0, fragSum = 0;
+    struct timespec t0, t1;
+
+    for (int op = 0; op < CHURN_OPS; op++) {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 16) % CHURN_SLOTS;
+        seed = seed * 1103515245 + 12345;
+        uint16_t size = (seed >> 16) % 4 == 0 ? 4096 : 8 + (seed >> 18) % 500;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (live[slot] != 0) {
+            freeMem(live[slot]);
+            live[slot] = 0;
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            freeSecs += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            frees++;
+        }
+        else {
+            uint16_t p = allocMem(size);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            allocSecs += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            allocs++;
+            if (p == 0) fails++;
+            else live[slot] = p;
+        }
+
+        if (op % CHURN_SAMPLE == 0) {
+            vm_freestats stats;
+            freeStats(&stats);
+            fragSum += freeFragPct(&stats);
+            samples++;
+        }
+    }
+
+    dprintf(fd, "alloc_ns_%s %f\n", policy, allocSecs * 1e9 / allocs);
+    dprintf(fd, "free_ns_%s %f\n", policy, freeSecs * 1e9 / frees);
+    dprintf(fd, "fragmentation_pct_%s %f\n", policy, fragSum / samples);
+    dprintf(fd, "alloc_fail_pct_%s %f\n", policy, 100.0 * fails / allocs);
+}
+
+// Record a metric, keeping the best value over repeated runs
+static void addMetric(const char *name, double value) {
+    bool higher = strstr(name, "_mips") != NULL;
+    for (int k = 0; k < metricCount; k++) {
+        if (strcmp(metrics[k].name, name) == 0) {
+            if (higher ? value > metrics[k].value : value < metrics[k].value) metrics[k].value = value;
+            return;
+        }
+    }
+    if (metricCount == BENCH_MAX_METRICS) return;
+    snprintf(metrics[metricCount].name, sizeof(metrics[0].name), "%s", name);
+    metrics[metricCount].value = value;
+    metrics[metricCount].higherIsBetter = higher;
+    metricCount++;
+}
+
+// Run a workload (or the allocator churn with the given policy when wl is NULL) in a child process and collect its metrics
+static void runForked(bench_workload *wl, const char *policy) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        freopen("/dev/null", "w", stdout); // Guest output, switch messages and VM reports are not part of this one
+        freopen("/dev/null", "w", stderr);
+        bool ok = true;
+        if (wl != NULL) ok = runWorkload(wl, fds[1]);
+        else runAllocator(policy, fds[1]);
+        fflush(stdout);
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+
+    FILE *in = fdopen(fds[0], "r");
+    char name[32];
+    double value;
+    while (fscanf(in, "%31s %lf", name, &value) == 2) {
+        addMetric(name, value);
+    }
+    fclose(in);
+
+    int status;
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Workload %s failed.\n", wl != NULL ? wl->name : policy);
+        exit(1);
+    }
+}
+
+// Compare the metrics against a baseline file, returning the number of regressions
+static int compareBaselines(const char *path, double tolerance) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Cannot open file %s.\n", path);
+        exit(1);
+    }
+
+    int regressions = 0;
+    char line[128], name[32];
+    double base;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%31s %lf", name, &base) != 2) continue;
+        for (int k = 0; k < metricCount; k++) {
+            if (strcmp(metrics[k].name, name) != 0) continue;
+            bench_metric *m = &metrics[k];
+            bool worse = m->higherIsBetter ? m->value < base * (1 - tolerance) : m->value > base * (1 + tolerance);
+            printf("%-26s %12.2f  baseline %12.2f  %s\n", name, m->value, base, worse ? "REGRESSION" : "ok");
+            regressions += worse;
+        }
+    }
+    fclose(in);
+    return regressions;
+}
+
+static void writeBaselines(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open file %s.\n", path);
+        exit(1);
+    }
+    fprintf(out, "# vmbench baselines: metric value (MIPS higher is better, the rest lower is better)\n");
+    for (int k = 0; k < metricCount; k++) {
+        fprintf(out, "%s %.2f\n", metrics[k].name, metrics[k].value);
+    }
+    fclose(out);
+}
+
+int main(int argc, char **argv) {
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+        for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+            runForked(&workloads[w], NULL);
+        }
+        for (size_t p = 0; p < sizeof(allocPolicyNames) / sizeof(allocPolicyNames[0]); p++) {
+            runForked(NULL, allocPolicyNames[p]);
+        }
+    }
+
+    for (int k = 0; k < metricCount; k++) {
+        if (argc < 2) printf("%-26s %12.2f\n", metrics[k].name, metrics[k].value);
+    }
+
+    if (argc >= 3 && strcmp(argv[2], "--update") == 0) {
+        writeBaselines(argv[1]);
+        return 0;
+    }
+    if (argc >= 2) {
+        char *opt = getenv("BENCH_TOLERANCE");
+        double tolerance = (opt != NULL ? atof(opt) : 30) / 100;
+        int regressions = compareBaselines(argv[1], tolerance);
+        if (regressions > 0) {
+            printf("%d metric(s) regressed by more than %.0f%%.\n", regressions, tolerance * 100);
+            return 1;
+        }
+    }
+    return 0;
+}